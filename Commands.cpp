@@ -1,17 +1,22 @@
 #include "Commands.h"
+#include "signals.h"
 
 using namespace std;
 
 // definition of CURR_FORK_CHILD_RUNNING`
 pid_t CURR_FORK_CHILD_RUNNING = 0;
 JobsList* GLOBAL_JOBS_POINTER = nullptr;
-double TIME_UNTIL_NEXT_ALARM = numeric_limits<double>::max();
-time_t TIME_AT_LAST_UPDATE = 0;
+unsigned long DIRECT_EXEC_COUNT = 0;
+unsigned long BASH_EXEC_COUNT = 0;
+int LAST_STATUS = 0;
 
 //----------------------GIVEN PARSING FUNCTIONS------------------------------------
 
 const std::string WHITESPACE = " \n\r\t\f\v";
 
+// characters that only bash knows how to handle (globs, variables, quoting, etc.)
+const std::string BASH_SPECIAL_CHARS = "*?[]{}()$'\"\\`~;&<>|#!=";
+
 #if 0
 #define FUNC_ENTRY()  \
   cerr << __PRETTY_FUNCTION__ << " --> " << endl;
@@ -28,35 +33,25 @@ const std::string WHITESPACE = " \n\r\t\f\v";
 #define EXEC(path, arg) \
   execvp((path), (arg));
 
-string _ltrim(const std::string& s) {
-    size_t start = s.find_first_not_of(WHITESPACE);
-    return (start == std::string::npos) ? "" : s.substr(start);
+// templates, for std::string and LineString alike
+template <class String>
+String _ltrim(const String& s) {
+    size_t start = s.find_first_not_of(WHITESPACE.c_str());
+    return (start == String::npos) ? String() : s.substr(start);
 }
-string _rtrim(const std::string& s) {
-    size_t end = s.find_last_not_of(WHITESPACE);
-    return (end == std::string::npos) ? "" : s.substr(0, end + 1);
+template <class String>
+String _rtrim(const String& s) {
+    size_t end = s.find_last_not_of(WHITESPACE.c_str());
+    return (end == String::npos) ? String() : s.substr(0, end + 1);
 }
-string _trim(const std::string& s) {
+template <class String>
+String _trim(const String& s) {
     return _rtrim(_ltrim(s));
 }
-int _parseCommandLine(const char* cmd_line, char** args) {
-    FUNC_ENTRY()
-    int i = 0;
-    std::istringstream iss(_trim(string(cmd_line)).c_str());
-    for (std::string s; iss >> s;) {
-        args[i] = (char *) malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = nullptr;
-    }
-    return i;
-
-    FUNC_EXIT()
-}
-
 //----------------------------OUR CODE-------------------------------------------
 
-bool checkAndRemoveAmpersand(string& str) {
+template <class String>
+bool checkAndRemoveAmpersand(String& str) {
     if (str.empty()) return false;
 
     bool has_ampersand = false;
@@ -76,13 +71,75 @@ bool checkAndRemoveAmpersand(string& str) {
     return has_ampersand;
 }
 
-bool isSmashChild() {
-    return getppid() == SMASH_PROCESS_PID;
-}
 bool isSmash() {
     return getpid() == SMASH_PROCESS_PID;
 }
 
+// attributes of a new child: a direct child of smash gets its own process group,
+// deeper children stay in the group of their parent
+SpawnAttributes childAttributes() {
+    SpawnAttributes attr;
+    if (isSmash()) attr.pgid = 0;
+    return attr;
+}
+
+/// \return The exit status of a wait status, like bash: the exit code, or 128 + the signal
+static int exitStatus(int wait_status) {
+    if (WIFSIGNALED(wait_status)) return 128 + WTERMSIG(wait_status);
+    return WEXITSTATUS(wait_status);
+}
+
+// the usage of the foreground processes is added here too while "time" runs a command
+static JobUsage* TIMED_USAGE = nullptr;
+
+bool waitForeground(pid_t pgid, unsigned int* processes, JobUsage* usage) {
+    bool stopped = false;
+    JobUsage used;  // by the processes reaped now
+    used.last_pid = usage->last_pid;
+    int64_t entered = phaseStart();
+    int64_t woken = entered;    // the last time it woke up, for PHASE_REAP
+    CURR_FORK_CHILD_RUNNING = pgid;
+    LAST_STATUS = 0;    // ctrlCHandler sets it if it kills the group
+
+    // wait for every process of the group, until one of them is stopped
+    while (*processes > 0) {
+        int status;
+        struct rusage child_usage;
+        pid_t waited = wait4(-pgid, &status, WUNTRACED | WNOHANG, &child_usage);
+        if (waited < 0) {
+            // ECHILD: the rest of the group was reaped with the jobs
+            if (errno != ECHILD) perror("smash error: wait4 failed");
+            break;
+        }
+        if (waited == 0) {
+            // nothing changed yet, handle events (ctrl-C/Z, timeouts) until a child does
+            waitForEvent();
+            woken = phaseStart();
+            *processes -= GLOBAL_JOBS_POINTER->claimExits(pgid, *processes, &used);
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            stopped = true;
+            break;
+        }
+        used.add(waited, status, child_usage);
+        (*processes)--;
+    }
+
+    // processes of the group that were reaped with the jobs
+    *processes -= GLOBAL_JOBS_POINTER->claimExits(pgid, *processes, &used);
+
+    usage->merge(used);
+    if (stopped) LAST_STATUS = 128 + SIGTSTP;
+    else if (usage->status != -1 && LAST_STATUS != 128 + SIGINT) LAST_STATUS = exitStatus(usage->status);
+    if (TIMED_USAGE != nullptr) TIMED_USAGE->merge(used);
+    if (woken != 0) phaseAdd(PHASE_WAIT, woken - entered);
+    phaseEnd(PHASE_REAP, woken);
+
+    CURR_FORK_CHILD_RUNNING = 0;
+    return stopped;
+}
+
 bool childWait(pid_t pid) {
     // i'm child of SMASH, just wait for grandchild and return
     if (!isSmash()) {
@@ -94,75 +151,207 @@ bool childWait(pid_t pid) {
 
 void printError(const string& msg) {
     std::cerr << "smash error: " << msg << endl;
+    LAST_STATUS = 1;
+}
+
+/// Finds the next ";", "&&" or "||" that separates commands (not one inside quotes, or inside
+/// "(...)", "$(...)", "{...}" or backticks, which are bash's)
+/// \return Pointer to it, or nullptr if there is none
+static const char* findChainOperator(const char* cmd_line) {
+    char quote = '\0';     // the quote the scan is inside of
+    int depth = 0;          // of the open parentheses and braces
+    bool backtick = false;
+    for (const char* c = cmd_line; *c != '\0'; c++) {
+        if (quote != '\0') {
+            if (*c == '\\' && quote == '"' && c[1] != '\0') c++;
+            else if (*c == quote) quote = '\0';
+        } else if (*c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (*c == '\'' || *c == '"') {
+            quote = *c;
+        } else if (*c == '`') {
+            backtick = !backtick;
+        } else if (*c == '(' || *c == '{') {
+            depth++;
+        } else if ((*c == ')' || *c == '}') && depth > 0) {
+            depth--;
+        } else if (depth > 0 || backtick) {
+            continue;
+        } else if (*c == ';' || (*c == '&' && c[1] == '&') || (*c == '|' && c[1] == '|')) {
+            return c;
+        }
+    }
+    return nullptr;
 }
 
-bool isBuiltInCommand(const string& cmd_part) {
-    if (cmd_part.compare("chprompt") == 0 || cmd_part.compare("chprompt&") == 0 || cmd_part.find("chprompt ") == 0) return true;
-    if (cmd_part.compare("showpid") == 0 || cmd_part.compare("showpid&") == 0 || cmd_part.find("showpid ") == 0) return true;
-    if (cmd_part.compare("pwd") == 0 || cmd_part.compare("pwd&") == 0 || cmd_part.find("pwd ") == 0) return true;
-    if (cmd_part.compare("cd") == 0 || cmd_part.compare("cd&") == 0 || cmd_part.find("cd ") == 0) return true;
-    if (cmd_part.compare("jobs") == 0 || cmd_part.compare("jobs&") == 0 || cmd_part.find("jobs ") == 0) return true;
-    if (cmd_part.compare("kill") == 0 || cmd_part.compare("kill&") == 0 || cmd_part.find("kill ") == 0) return true;
-    if (cmd_part.compare("fg") == 0 || cmd_part.compare("fg&") == 0 || cmd_part.find("fg ") == 0) return true;
-    if (cmd_part.compare("bg") == 0 || cmd_part.compare("bg&") == 0 || cmd_part.find("bg ") == 0) return true;
-    if (cmd_part.compare("quit") == 0 || cmd_part.compare("quit&") == 0 || cmd_part.find("quit ") == 0) return true;
-
-// TODO: maybe timeout isn't built in commmand for that matter
-    if (cmd_part.compare("timeout") == 0 || cmd_part.compare("timeout&") == 0 || cmd_part.find("timeout ") == 0) return true;
-
+// the keywords that start a compound command of bash
+static const char* const COMPOUND_KEYWORDS[] = {"for", "while", "until", "if", "case"};
+
+/// \return True if the line has bash syntax smash doesn't parse: a subshell, a group,
+/// a command substitution or a compound command (it's given to bash whole)
+static bool isCompoundLine(const char* cmd_line) {
+    const char* word = cmd_line + strspn(cmd_line, " \n\r\t\f\v");
+    size_t length = strcspn(word, " \n\r\t\f\v;&|");
+    for (const char* keyword : COMPOUND_KEYWORDS) {
+        if (length == strlen(keyword) && strncmp(word, keyword, length) == 0) return true;
+    }
+
+    char quote = '\0';
+    for (const char* c = cmd_line; *c != '\0'; c++) {
+        if (quote != '\0') {
+            if (*c == '\\' && quote == '"' && c[1] != '\0') c++;
+            else if (*c == quote) quote = '\0';
+            else if (quote == '"' && (*c == '`' || (*c == '$' && c[1] == '('))) return true;
+        } else if (*c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (*c == '\'' || *c == '"') {
+            quote = *c;
+        } else if (*c == '(' || *c == '{' || *c == '`') {
+            return true;
+        }
+    }
     return false;
 }
 
-void updateAlarm(unsigned int duration) {
-    // update alarm
-    time_t curr_time = time(nullptr);
-    if (curr_time == (time_t)(-1)) {
-        perror("smash error: time failed");
-    } else if (TIME_UNTIL_NEXT_ALARM < numeric_limits<double>::max()) {
-        // if there is an upcoming alarm
-        // update the leftover duration
-        TIME_UNTIL_NEXT_ALARM -= difftime(curr_time, TIME_AT_LAST_UPDATE);
-    }
+/// \return True if the line has a redirection smash doesn't do: a here-document ("<<"),
+/// a here-string ("<<<") or a process substitution ("<(...)", ">(...)")
+static bool hasBashRedirection(const char* cmd_line) {
+    return strstr(cmd_line, "<<") != nullptr || strstr(cmd_line, "<(") != nullptr ||
+           strstr(cmd_line, ">(") != nullptr;
+}
 
-    // if the time limit (of the current command) is less than the time until next alarm
-    if ((double)duration < TIME_UNTIL_NEXT_ALARM) {
-        // set new alarm (corresponding to this command)
-        alarm(duration);
+bool isBuiltInCommand(const char* cmd_part) {
+    // commands that run inside smash (cp runs in a child of its own)
+    const BuiltinEntry* builtin = findBuiltin(cmd_part);
+    return builtin != nullptr && !(builtin->flags & BUILTIN_FORKS);
+}
 
-        // update time until next alarm
-        TIME_UNTIL_NEXT_ALARM = duration;
-    }
-    TIME_AT_LAST_UPDATE = curr_time;
+bool isExternalCommand(const char* cmd_part) {
+    // the same checks as SmallShell::CreateCommand, without building the command
+    if (strchr(cmd_part, '|') != nullptr) return false;
+    if (strpbrk(cmd_part, "<>") != nullptr && !hasBashRedirection(cmd_part)) return false;
+    return findBuiltin(cmd_part) == nullptr;
 }
-//---------------------------JOBS LISTS------------------------------
-JobEntry::JobEntry(pid_t pid, const string& cmd_str, bool is_stopped, bool is_timeout, unsigned int time_limit) : pid(pid),
-                                                                                                                cmd_str(cmd_str),
-                                                                                                                is_stopped(is_stopped),
-                                                                                                                is_timeout(is_timeout),
-                                                                                                                time_limit(time_limit) {
+
+JobEntry::JobEntry(pid_t pid, const string& cmd_str, bool is_stopped, bool is_timeout, TimerID timer) : pid(pid),
+                                                                                                        cmd_str(cmd_str),
+                                                                                                        is_stopped(is_stopped),
+                                                                                                        is_timeout(is_timeout),
+                                                                                                        is_queued(false),
+                                                                                                        token(JOBSERVER_NO_TOKEN),
+                                                                                                        timer(timer),
+                                                                                                        processes(1) {
     SetTime();
-    original_start_time = start_time;
 }
+JobUsage::JobUsage() : started(monotonicNow()), exited(0), last_pid(0), status(-1), user_time(), system_time(),
+                       max_rss(0), voluntary_switches(0), involuntary_switches(0) {
+}
+void JobUsage::add(pid_t pid, int wait_status, const struct rusage& usage) {
+    exited++;
+    if (last_pid == 0 || pid == last_pid) status = wait_status;
+    timeradd(&user_time, &usage.ru_utime, &user_time);
+    timeradd(&system_time, &usage.ru_stime, &system_time);
+    max_rss = std::max(max_rss, usage.ru_maxrss);
+    voluntary_switches += usage.ru_nvcsw;
+    involuntary_switches += usage.ru_nivcsw;
+}
+void JobUsage::merge(const JobUsage& other) {
+    if (last_pid == 0) last_pid = other.last_pid;
+    if (other.exited == 0) return;
+    exited += other.exited;
+    if (other.status != -1 && (last_pid == 0 || other.last_pid == last_pid)) status = other.status;
+    timeradd(&user_time, &other.user_time, &user_time);
+    timeradd(&system_time, &other.system_time, &system_time);
+    max_rss = std::max(max_rss, other.max_rss);
+    voluntary_switches += other.voluntary_switches;
+    involuntary_switches += other.involuntary_switches;
+}
+
 void JobEntry::SetTime() {
     start_time = time(nullptr);
     if (start_time == (time_t)(-1)) perror("smash error: time failed");
 }
 
-JobEntry* JobsList::addJob(pid_t pid, const string& cmd_str, bool is_stopped, bool is_timeout, unsigned int time_limit) {
+JobEntry* JobsList::addJob(pid_t pid, const string& cmd_str, bool is_stopped, bool is_timeout,
+                           TimerID timer, unsigned int processes) {
     // remove zombies from jobs list
     removeFinishedJobs();
 
-    // create new job entry
-    JobEntry new_job(pid, cmd_str, is_stopped, is_timeout, time_limit);
+    // create new job entry, without the processes that were already reaped
+    JobEntry new_job(pid, cmd_str, is_stopped, is_timeout, timer);
+    new_job.processes = processes - claimExits(pid, processes, &new_job.usage);
+    new_job.token = pending_token;  // the slot it was started with, if it's a background job
+    pending_token = JOBSERVER_NO_TOKEN;
     JobID new_id = 1;
-    if (!jobs.empty()) new_id = jobs.rbegin()->first + 1;
+    if (next_job_id != 0) {    // a queued job that starts now
+        new_id = next_job_id;
+        next_job_id = 0;
+    } else if (!jobs.empty()) {
+        new_id = jobs.rbegin()->first + 1;
+    }
 
-    // insert to map
+    // insert to map and index
     jobs[new_id] = new_job;
+    job_of_group[pid] = new_id;
+
+    // already finished, remove it next time
+    if (new_job.processes == 0) finished_jobs.push_back(new_id);
 
     return &jobs[new_id];
 }
-void JobsList::printJobsList() {
+// adds what a process that isn't reaped yet used so far (with its reaped children), from /proc
+static void addLiveUsage(pid_t pid, JobUsage* usage) {
+    std::ifstream stat_file("/proc/" + to_string(pid) + "/stat");
+    string stat;
+    if (!getline(stat_file, stat)) return;  // already exited
+
+    // the fields after the command name (which may have spaces): utime, stime, cutime
+    // and cstime are the 12th to 15th, in clock ticks
+    size_t name_end = stat.rfind(')');
+    if (name_end == string::npos) return;
+    std::istringstream fields(stat.substr(name_end + 1));
+    string skipped;
+    for (int i = 0; i < 11; i++) fields >> skipped;
+    long long ticks[4] = {0, 0, 0, 0};
+    for (long long& field : ticks) fields >> field;
+
+    static const long TICKS_PER_SECOND = sysconf(_SC_CLK_TCK);
+    for (int i = 0; i < 4; i++) {
+        struct timeval time;
+        time.tv_sec = ticks[i] / TICKS_PER_SECOND;
+        time.tv_usec = ticks[i] % TICKS_PER_SECOND * 1000000 / TICKS_PER_SECOND;
+        struct timeval* total = (i % 2 == 0) ? &usage->user_time : &usage->system_time;
+        timeradd(total, &time, total);
+    }
+
+    std::ifstream status_file("/proc/" + to_string(pid) + "/status");
+    string key;
+    long value;
+    while (status_file >> key) {
+        if (key == "VmHWM:" && status_file >> value) usage->max_rss = std::max(usage->max_rss, value);
+        else if (key == "voluntary_ctxt_switches:" && status_file >> value) usage->voluntary_switches += value;
+        else if (key == "nonvoluntary_ctxt_switches:" && status_file >> value) usage->involuntary_switches += value;
+    }
+}
+
+// "real=... user=... sys=... maxrss=... vcsw=... ivcsw=..." and the status of the job
+static string formatUsage(const JobUsage& usage, int64_t real_time) {
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(6);
+    text << "real=" << real_time / 1e9 << "s";
+    text << std::setprecision(3);
+    text << " user=" << usage.user_time.tv_sec + usage.user_time.tv_usec / 1e6 << "s";
+    text << " sys=" << usage.system_time.tv_sec + usage.system_time.tv_usec / 1e6 << "s";
+    text << " maxrss=" << usage.max_rss << "KiB";
+    text << " vcsw=" << usage.voluntary_switches << " ivcsw=" << usage.involuntary_switches;
+    if (usage.status != -1) {
+        if (WIFSIGNALED(usage.status)) text << " status=signal" << WTERMSIG(usage.status);
+        else text << " status=" << WEXITSTATUS(usage.status);
+    }
+    return text.str();
+}
+
+void JobsList::printJobsList(bool long_format) {
     // remove zombies from jobs list
     removeFinishedJobs();
 
@@ -175,9 +364,16 @@ void JobsList::printJobsList() {
 
         cout << "[" << job.first << "]";
         cout << " " << job.second.cmd_str;
-        cout << " : " << job.second.pid;
+        if (job.second.is_queued) cout << " : queued";
+        else cout << " : " << job.second.pid;
         cout << " " << diff_time << " secs";
         if (job.second.is_stopped) cout << " (stopped)";
+        if (long_format && !job.second.is_queued) {
+            // the reaped processes, and the group leader while it runs
+            JobUsage usage = job.second.usage;
+            addLiveUsage(job.second.pid, &usage);
+            cout << " : " << formatUsage(usage, monotonicNow() - usage.started);
+        }
         cout << endl;
     }
 }
@@ -185,54 +381,109 @@ void JobsList::killAllJobs() {
     // remove zombies from jobs list
     removeFinishedJobs();
 
-    cout << "smash: sending SIGKILL signal to " << jobs.size() << " jobs:" << endl;
+    // the queued jobs never started, they're just dropped
+    cout << "smash: sending SIGKILL signal to " << jobs.size() - queued_jobs.size() << " jobs:" << endl;
 
     // iterate on map, print message and send SIGKILL then wait them
     for (auto& job : jobs) {
+        if (job.second.is_queued) continue;
         cout << job.second.pid << ": " << job.second.cmd_str << endl;
-        pid_t gpid = getpgid(job.second.pid);
-        if (gpid < 0) {
-            perror("smash error: getgpid failed");
+        cancelTimer(job.second.timer);  // it won't time out anymore
+
+        // send sigkill to a process group (every job leads its own group)
+        if (killpg(job.second.pid, SIGKILL) < 0) {
+            perror("smash error: killpg failed");
         } else {
-            // send sigkill to a process group
-            if (killpg(gpid, SIGKILL) < 0) {
-                perror("smash error: killpg failed");
-            } else {
-                if (waitpid(job.second.pid, nullptr, 0) < 0)
+            for (; job.second.processes > 0; job.second.processes--) {
+                if (waitpid(-job.second.pid, nullptr, 0) < 0) {
                     perror("smash error: waitpid failed");
+                    break;
+                }
             }
         }
         job.second.pid = 0;
+        releaseToken(job.second);
     }
 
     jobs.clear();
+    job_of_group.clear();
+    unclaimed_exits.clear();
+    finished_jobs.clear();
+    queued_jobs.clear();
 }
 
 void JobsList::removeFinishedJobs() {
     if (!isSmash()) return; // not the SMASH
 
-    vector<JobID> to_remove(100,0);
-    int to_remove_iter= 0;
+    // remove the jobs that finished before they were added
+    for (JobID job_id : finished_jobs) {
+        auto job = jobs.find(job_id);
+        if (job != jobs.end() && job->second.processes == 0 && job->second.pid != CURR_FORK_CHILD_RUNNING) {
+            removeJobById(job_id);
+        }
+    }
+    finished_jobs.clear();
 
-    // iterate on map looking for finished jobs
-    for (const auto& job : jobs) {
-        // pid = 0 --> it's set to be removed
-        if (job.second.pid == 0) {
-            to_remove[to_remove_iter++] = job.first;
+    // nothing exited since the last time
+    if (!childSignalReceived()) return;
+
+    while (true) {
+        // find a finished child without reaping it, so its group can still be read
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+            if (errno != ECHILD) perror("smash error: waitid failed");
+            break;
+        }
+        if (info.si_pid == 0) break;    // no more finished children
+
+        pid_t pgid = getpgid(info.si_pid);
+        int status;
+        struct rusage usage;
+        if (wait4(info.si_pid, &status, WNOHANG, &usage) < 0) {
+            perror("smash error: wait4 failed");
+            break;
+        }
+        if (pgid < 0) {
+            perror("smash error: getpgid failed");
             continue;
         }
 
-        // check if job finished using waitpid with WNOHANG
-        pid_t waited = waitpid(job.second.pid, nullptr, WNOHANG);
-        if (waited < 0) perror("smash error: waitpid failed");
-        if (waited > 0) to_remove[to_remove_iter++] = job.first;
+        processExited(pgid, info.si_pid, status, usage);
     }
+}
+void JobsList::processExited(pid_t pgid, pid_t pid, int status, const struct rusage& usage) {
+    auto job_id = job_of_group.find(pgid);
+    if (job_id == job_of_group.end()) {
+        // not a job (yet), keep it for whoever waits for the group
+        unclaimed_exits[pgid].add(pid, status, usage);
+        return;
+    }
+
+    JobEntry& job = jobs[job_id->second];
+    if (job.processes > 0) job.processes--;
+    job.usage.add(pid, status, usage);
 
-    // remove from map all waited jobs
-    for (int i = 0; i < to_remove_iter; i++) {
-        jobs.erase(to_remove[i]);
+    // every process of the job finished, remove it
+    // (unless it's in the foreground, then whoever waits for it removes it)
+    if (job.processes == 0 && pgid != CURR_FORK_CHILD_RUNNING) {
+        releaseToken(job);
+        jobs.erase(job_id->second);
+        job_of_group.erase(job_id);
     }
 }
+unsigned int JobsList::claimExits(pid_t pgid, unsigned int max, JobUsage* usage) {
+    auto unclaimed = unclaimed_exits.find(pgid);
+    if (unclaimed == unclaimed_exits.end()) return 0;
+
+    unsigned int claimed = std::min(unclaimed->second.exited, max);
+    if (usage != nullptr) usage->merge(unclaimed->second);
+    unclaimed_exits.erase(unclaimed);
+    return claimed;
+}
+void JobsList::setLastProcess(pid_t pgid, pid_t pid) {
+    unclaimed_exits[pgid].last_pid = pid;
+}
 JobEntry* JobsList::getJobById(JobID jobId) {
     // remove zombies from jobs list
     removeFinishedJobs();
@@ -242,9 +493,27 @@ JobEntry* JobsList::getJobById(JobID jobId) {
     // return from map
     return &jobs[jobId];
 }
+JobEntry* JobsList::getJobByPid(pid_t pid) {
+    auto job_id = job_of_group.find(pid);
+    if (job_id == job_of_group.end()) return nullptr;
+    return &jobs[job_id->second];
+}
 void JobsList::removeJobById(JobID jobId) {
     // if not exist nothing happens
-    jobs.erase(jobId);
+    auto job = jobs.find(jobId);
+    if (job == jobs.end()) return;
+
+    releaseToken(job->second);
+    job_of_group.erase(job->second.pid);
+    jobs.erase(job);
+}
+void JobsList::removeJobByPid(pid_t pid) {
+    auto job_id = job_of_group.find(pid);
+    if (job_id == job_of_group.end()) return;
+
+    releaseToken(jobs[job_id->second]);
+    jobs.erase(job_id->second);
+    job_of_group.erase(job_id);
 }
 
 JobEntry* JobsList::getLastJob(JobID* lastJobId) {
@@ -272,251 +541,577 @@ JobEntry* JobsList::getLastStoppedJob(JobID* jobId) {
 
     return nullptr;
 }
+bool JobsList::mustQueue() {
+    if (!jobserver.active() || next_job_id != 0) return false;  // no limit, or a queued job is starting
+    if (!queued_jobs.empty()) return true;  // first in first out
+
+    removeFinishedJobs();   // may give the implicit token back
+    pending_token = jobserver.acquire();
+    return pending_token == JOBSERVER_NO_TOKEN;
+}
+void JobsList::queueJob(const string& cmd_str) {
+    JobID new_id = 1;
+    if (!jobs.empty()) new_id = jobs.rbegin()->first + 1;
+
+    JobEntry new_job(0, cmd_str);
+    new_job.is_queued = true;
+    new_job.processes = 0;
+    jobs[new_id] = new_job;
+    queued_jobs.push_back(new_id);
+}
+bool JobsList::slotAvailable() {
+    if (queued_jobs.empty()) return false;
+    if (!jobserver.active()) return true;
+
+    if (pending_token == JOBSERVER_NO_TOKEN) {
+        removeFinishedJobs();
+        pending_token = jobserver.acquire();
+    }
+    return pending_token != JOBSERVER_NO_TOKEN;
+}
+string JobsList::takeQueuedJob(JobID jobId) {
+    auto job = jobs.find(jobId);
+    if (job == jobs.end() || !job->second.is_queued) return "";
+
+    // usually the first one, fg may take one from the middle
+    auto queued = std::find(queued_jobs.begin(), queued_jobs.end(), jobId);
+    if (queued != queued_jobs.end()) queued_jobs.erase(queued);
+
+    string cmd_str = job->second.cmd_str;
+    jobs.erase(job);
+    return cmd_str;
+}
+void JobsList::releasePendingToken() {
+    if (!isSmash()) return;     // a copy in a child
+    jobserver.release(pending_token);
+    pending_token = JOBSERVER_NO_TOKEN;
+}
+void JobsList::releaseToken(JobEntry& job) {
+    if (!isSmash()) return;     // a copy in a child
+    jobserver.release(job.token);
+    job.token = JOBSERVER_NO_TOKEN;
+}
+JobsList::~JobsList() {
+    // the slots go back to the jobserver, even of the jobs that still run
+    for (auto& job : jobs) releaseToken(job.second);
+    releasePendingToken();
+}
 //-------------------------SPECIAL COMMANDS-------------------------
 PipeCommand::PipeCommand(const char* cmd_line, SmallShell* shell) : Command(cmd_line),
                                                                     shell(shell),
-                                                                    has_ampersand(false),
-                                                                    background(false) {
-    // parse
-    string command(cmd_line);
-    int pipe_index = command.find_first_of("|");
-
-    command1 = _trim(command.substr(0, pipe_index));
-    checkAndRemoveAmpersand(command1); // don't run inner command in background
+                                                                    background(false),
+                                                                    invalid_args(false),
+                                                                    producer(0) {
+    // parse: split to stages at every "|", "|&" or "|+"
+    const LineString& command = original_cmd;
+    bool fan_out = false;   // a "|+" was seen
+    size_t stage_start = 0;
+    while (true) {
+        size_t pipe_index = command.find('|', stage_start);
+        LineString stage = _trim(command.substr(stage_start, pipe_index - stage_start));
+
+        if (pipe_index == string::npos) {   // last stage
+            if (checkAndRemoveAmpersand(stage)) background = true;   // check for & at the end
+            stages.push_back(stage);
+            break;
+        }
 
-    if (cmd_line[pipe_index + 1] == '&') {
-        has_ampersand = true;
-        pipe_index++;         // in order for command2 to start after the ampersand
-    }
+        checkAndRemoveAmpersand(stage); // don't run inner command in background
+        stages.push_back(stage);
 
-    command2 = _trim(command.substr(pipe_index+1, command.length() - pipe_index - 1));
-    if (checkAndRemoveAmpersand(command2)) background = true;   // check for & at the end
+        bool has_ampersand = command[pipe_index + 1] == '&';
+        bool has_plus = command[pipe_index + 1] == '+';
+        to_stderr.push_back(has_ampersand);
+        stage_start = pipe_index + (has_ampersand || has_plus ? 2 : 1);     // the next stage starts after the operator
 
-    // if the first command is jobs, update jobs because child can't
-    if (command1.compare("jobs") == 0 || command1.find("jobs ") == 0) {
-        shell->updateJobs();
+        // every stage after the first "|+" reads the output of the stage before it
+        if (has_plus && !fan_out) producer = stages.size() - 1;
+        if (fan_out && !has_plus) invalid_args = true;
+        fan_out = fan_out || has_plus;
     }
 
-    // if the second command is jobs, update jobs because child can't
-    if (command2.compare("jobs") == 0 || command2.find("jobs ") == 0) {
-        shell->updateJobs();
+    if (invalid_args) {
+        printError("pipe: only |+ can come after |+");
+        return;
     }
+    // "a |+ b" alone is "a | b"
+    if (!fan_out || producer + 2 == stages.size()) producer = stages.size();
+
 }
 void PipeCommand::execute() {
+    if (invalid_args) return;
+
     // if first command fg, just call fg
-    if (command1.find("fg ") == 0) {
-        shell->executeCommand(command1.c_str());
+    if (stages[0].find("fg ") == 0) {
+        shell->executeCommand(stages[0].c_str());
         return;
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0) { // child process
-        if (isSmashChild()) setpgrp();      // make sure that the child gets a different GROUP ID
+    // if one of the forked commands is jobs, update jobs because child can't (at the head it runs in smash)
+    for (unsigned int i = headRunsInSmash() ? 1 : 0; i < stages.size(); i++) {
+        const LineString& stage = stages[i];
+        if (stage.compare("jobs") == 0 || stage.find("jobs ") == 0) {
+            shell->updateJobs();
+            break;
+        }
+    }
 
+    // create all the pipes: the stages up to the producer are connected in a row, and with "|+"
+    // the producer writes to a chain of relays, relay i feeds consumer i and the next relay
+    // (the last one feeds the last two consumers)
+    unsigned int count = stages.size();
+    unsigned int relays = producer < count ? count - producer - 2 : 0;
+    vector<int> pipes;
+    vector<int> inputs(count, -1), outputs(count, -1);
+    vector<int> relay_inputs(relays), tee_outputs(relays), splice_outputs(relays);
+    auto createPipe = [&pipes](int* read_end, int* write_end) {
         int my_pipe[2];
-        if (pipe(my_pipe) == -1) {
-            perror("smash error: pipe failed");
-            exit(0);
-        }
+        if (pipe(my_pipe) == -1) return false;
+        pipes.push_back(*read_end = my_pipe[0]);
+        pipes.push_back(*write_end = my_pipe[1]);
+        return true;
+    };
+    bool created = true;
+    for (unsigned int i = 0; i + 1 < std::min(count, producer + 1); i++) {
+        created = created && createPipe(&inputs[i + 1], &outputs[i]);
+    }
+    for (unsigned int i = 0; i < relays && created; i++) {
+        // its input: the producer, or the previous relay
+        created = i == 0 ? createPipe(&relay_inputs[0], &outputs[producer])
+                         : createPipe(&relay_inputs[i], &splice_outputs[i - 1]);
+        created = created && createPipe(&inputs[producer + 1 + i], &tee_outputs[i]);
+    }
+    if (created && relays > 0) created = createPipe(&inputs[count - 1], &splice_outputs[relays - 1]);
+    if (!created) {
+        perror("smash error: pipe failed");
+        for (int fd : pipes) if (close(fd) == -1) perror("smash error: close failed");
+        return;
+    }
 
-        pid_t pid1, pid2;
-        bool success = Pipe(my_pipe, &pid1, &pid2);
+    // spawn all the stages directly, the first one leads the group of the pipeline
+    // (a built-in command at the head isn't spawned, smash runs it)
+    unsigned int first = headRunsInSmash() ? 1 : 0;
+    vector<pid_t> pids;
+    pid_t pgid = isSmash() ? 0 : -1;
+    for (unsigned int i = first; i < count; i++) {
+        pid_t pid = spawnStage(i, inputs[i], outputs[i], pipes, pgid);
+        if (pid < 0) break;
+        pids.push_back(pid);
+        if (pgid == 0) pgid = pid;
+    }
+    for (unsigned int i = 0; i < relays && pids.size() >= count - first; i++) {
+        pid_t pid = spawnRelay(relay_inputs[i], tee_outputs[i], splice_outputs[i], pipes, pgid);
+        if (pid < 0) break;
+        pids.push_back(pid);
+    }
 
-        // close pipe
-        if (close(my_pipe[0]) == -1) perror("smash error: close failed");
-        if (close(my_pipe[1]) == -1) perror("smash error: close failed");
+    // close pipe, only the stages use it (and the head if it runs in smash)
+    for (int fd : pipes) {
+        if (first == 1 && fd == outputs[0]) continue;
+        if (close(fd) == -1) perror("smash error: close failed");
+    }
 
-        if (!success) {
-            pid_t gpid = getpgrp();
-            if (gpid < 0) {
-                perror("smash error: getpgrp failed");
-                exit(0);
-            }
-            // kill this process and it's children
-            if (killpg(gpid, SIGINT) < 0) perror("smash error: killpg failed");
-            exit(0);
-        }
+    if (pids.size() < count - first + relays) {
+        if (first == 1 && close(outputs[0]) == -1) perror("smash error: close failed");
+        // kill the stages that were already spawned
+        for (pid_t pid : pids) if (kill(pid, SIGKILL) < 0) perror("smash error: kill failed");
+        for (pid_t pid : pids) if (waitpid(pid, nullptr, 0) < 0) perror("smash error: waitpid failed");
+        return;
+    }
 
-        if (waitpid(pid1, nullptr, 0) < 0) perror("smash error: waitpid failed");
-        if (waitpid(pid2, nullptr, 0) < 0) perror("smash error: waitpid failed");
-        exit(0);
-    } else if (pid < 0) {
-        perror("smash error: fork failed");
+    if (!isSmash()) {
+        // i'm child of SMASH, just wait for the stages and return
+        for (pid_t pid : pids) if (waitpid(pid, nullptr, 0) < 0) perror("smash error: waitpid failed");
         return;
     }
 
-    if (childWait(pid)) return;
+    // its status is the one of the last stage, whichever stage is reaped last
+    JobUsage usage;
+    usage.last_pid = pids[count - first - 1];
+    GLOBAL_JOBS_POINTER->setLastProcess(pgid, usage.last_pid);
 
+    if (first == 1) runHead(outputs[0]);
+
+    unsigned int processes = pids.size();
     if (background) {   // run in background
-        shell->addJob(pid, original_cmd);
-    } else {            // run in foreground
-        CURR_FORK_CHILD_RUNNING = pid;
-        int status;
-        // wait for child to finish
-        if (waitpid(pid, &status, WUNTRACED) < 0) {
-            perror("smash error: waitpid failed");
-        } else {
-            // add to jobs list if stopped
-            if (WIFSTOPPED(status)) shell->addJob(pid, original_cmd, true);
+        shell->addJob(pgid, original_cmd.c_str(), false, false, 0, processes);
+    } else if (waitForeground(pgid, &processes, &usage)) {  // run in foreground
+        // add to jobs list if stopped
+        shell->addJob(pgid, original_cmd.c_str(), true, false, 0, processes)->usage = usage;
+    }
+}
+
+// output of the built-in commands at the head of pipelines, that the pipes didn't take yet
+struct PipeWriter {
+    int fd;         // write end of the pipe, non-blocking
+    string data;
+    size_t written;
+};
+static std::list<PipeWriter> PIPE_WRITERS;
+
+/// Writes what the pipes take of every pending output, and closes the pipes that are done
+/// (or whose readers are gone). The others are written again when they become writable.
+static void writePipes() {
+    // a pipe without readers raises SIGPIPE, which would kill smash: it's taken back instead
+    sigset_t pipe_signal, old_mask;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+    for (auto writer = PIPE_WRITERS.begin(); writer != PIPE_WRITERS.end();) {
+        ssize_t bytes = 0;
+        while (writer->written < writer->data.size() &&
+               (bytes = write(writer->fd, writer->data.data() + writer->written,
+                              writer->data.size() - writer->written)) > 0) {
+            writer->written += bytes;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {  // the pipe is full
+            watchWritableOnce(writer->fd, writePipes);
+            writer++;
+            continue;
+        }
+        if (bytes < 0 && errno == EPIPE) {
+            struct timespec no_wait = {0, 0};
+            sigtimedwait(&pipe_signal, nullptr, &no_wait);
+        } else if (bytes < 0) {
+            perror("smash error: write failed");
         }
-        CURR_FORK_CHILD_RUNNING = 0;
+
+        unwatch(writer->fd);
+        if (close(writer->fd) == -1) perror("smash error: close failed");
+        writer = PIPE_WRITERS.erase(writer);
     }
+
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
 }
 
-bool PipeCommand::Pipe(int my_pipe[], pid_t* pid1, pid_t* pid2) {
-    *pid1 = fork();
-    if (*pid1 == 0) {    // child process for command1
-        // close read channel
-        if (close(my_pipe[0]) == -1) perror("smash error: close failed");
+bool PipeCommand::headRunsInSmash() const {
+    // like any other stage, the head runs in a child of its own unless all it does is print: the
+    // commands that change smash (cd, quit, fg...) have no effect there, and redirections use the real fds
+    if (!isSmash() || stages[0].find_first_of("<>") != LineString::npos) return false;
+    const BuiltinEntry* builtin = findBuiltin(stages[0].c_str());
+    return builtin != nullptr && (builtin->flags & BUILTIN_PRINTS);
+}
 
-        //set the new write channel
-        int write_channel = has_ampersand ? STDERR : STDOUT;
-        if (dup2(my_pipe[1], write_channel) == -1) {
-            perror("smash error: dup2 failed");
-            if (close(my_pipe[1]) == -1) perror("smash error: close failed");
-            exit(0);
-        }
+void PipeCommand::runHead(int output) {
+    // smash keeps the write end open while the output is pending, the commands it runs meanwhile
+    // must not get it (the reader would see the end of its input only when they are done too)
+    if (fcntl(output, F_SETFD, FD_CLOEXEC) == -1) perror("smash error: fcntl failed");
 
-        shell->executeCommand(command1.c_str()); // execute the command before the pipe
-        exit(0);
+    // the built-in commands print with cout (and cerr), so their output is collected from it
+    std::ostringstream collected;
+    std::streambuf* old_out = std::cout.rdbuf(collected.rdbuf());
+    std::streambuf* old_err = to_stderr[0] ? std::cerr.rdbuf(collected.rdbuf()) : nullptr;
+    shell->executeCommand(stages[0].c_str());
+    std::cout.rdbuf(old_out);
+    if (old_err != nullptr) std::cerr.rdbuf(old_err);
 
-    } else if (*pid1 < 0)  {
+    if (fcntl(output, F_SETFL, O_NONBLOCK) == -1) perror("smash error: fcntl failed");
+    PIPE_WRITERS.push_back(PipeWriter{output, collected.str(), 0});
+    writePipes();
+}
+
+pid_t PipeCommand::spawnStage(unsigned int index, int input, int output, const vector<int>& pipes, pid_t pgid) {
+    SpawnAttributes attr;
+    attr.pgid = pgid;
+
+    // set the read channel to the previous pipe and the write channel to the next one
+    if (input >= 0) attr.addDup2(input, STDIN);
+    if (output >= 0) attr.addDup2(output, to_stderr[index] ? STDERR : STDOUT);
+    for (int fd : pipes) attr.addClose(fd);
+
+    if (isExternalCommand(stages[index].c_str())) {
+        // the pipeline is the job, not the stage
+        ExternalCommand cmd(stages[index].c_str(), nullptr);
+        pid_t pid = cmd.spawn(attr);
+        if (pid < 0) perror("smash error: posix_spawn failed");
+        return pid;
+    }
+    if (strpbrk(stages[index].c_str(), "<>") != nullptr) {
+        // an external command with redirections gets them after the pipes
+        RedirectionCommand cmd(stages[index].c_str(), shell);
+        if (cmd.isExternal()) return cmd.spawn(attr);
+    }
+
+    // built-in and special commands run smash code, so they need a fork of smash
+    pid_t pid = spawnFork(attr);
+    if (pid == 0) {
+        shell->executeCommand(stages[index].c_str());
+        exit(0);
+    } else if (pid < 0) {
         perror("smash error: fork failed");
-        return false;
     }
+    return pid;
+}
 
-    *pid2 = fork();
-    if (*pid2 == 0) {    // child process for command2
-        // close write channel
-        if (close(my_pipe[1]) == -1) perror("smash error: close failed");
+// discards length bytes of a pipe
+static void skipInput(int input, ssize_t length) {
+    char buffer[4096];
+    while (length > 0) {
+        ssize_t skipped = read(input, buffer, std::min<ssize_t>(length, sizeof(buffer)));
+        if (skipped < 0 && errno == EINTR) continue;
+        if (skipped <= 0) return;
+        length -= skipped;
+    }
+}
 
-        // set the new read channel
-        if (dup2(my_pipe[0], STDIN) == -1) {
-            perror("smash error: dup2 failed");
-            if (close(my_pipe[0]) == -1) perror("smash error: close failed");
-            exit(0);
-        }
+// copies everything from the input pipe to both output pipes without reading it:
+// tee duplicates the pages of the input into tee_output, then splice moves the same
+// pages to splice_output (and consumes them). A consumer that exits just stops getting it.
+static void relayFanOut(int input, int tee_output, int splice_output) {
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) perror("smash error: signal failed");
 
-        shell->executeCommand(command2.c_str()); // execute the command after the pipe
-        exit(0);
+    while (tee_output >= 0 && splice_output >= 0) {
+        ssize_t length = tee(input, tee_output, PIPE_RELAY_CHUNK_SIZE, 0);
+        if (length == 0) return;    // end of input
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EPIPE) perror("smash error: tee failed");
+            close(tee_output);
+            tee_output = -1;
+            break;
+        }
 
-    }  else if (*pid2 < 0) {
-        perror("smash error: fork failed");
-        return false;
+        while (length > 0) {
+            ssize_t moved = splice(input, nullptr, splice_output, nullptr, length, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR) continue;
+            if (moved <= 0) {
+                if (moved < 0 && errno != EPIPE) perror("smash error: splice failed");
+                close(splice_output);
+                splice_output = -1;
+                skipInput(input, length);   // tee_output already has them
+                break;
+            }
+            length -= moved;
+        }
     }
 
-    return true;
+    // one consumer is left, move the rest to it
+    int output = tee_output >= 0 ? tee_output : splice_output;
+    while (true) {
+        ssize_t moved = splice(input, nullptr, output, nullptr, PIPE_RELAY_CHUNK_SIZE, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved < 0 && errno != EPIPE) perror("smash error: splice failed");
+        if (moved <= 0) return;
+    }
 }
 
+pid_t PipeCommand::spawnRelay(int input, int tee_output, int splice_output, const vector<int>& pipes, pid_t pgid) {
+    SpawnAttributes attr;
+    attr.pgid = pgid;
+
+    pid_t pid = spawnFork(attr);
+    if (pid == 0) {
+        // the consumers see the end of their input only when every write end is closed
+        for (int fd : pipes) {
+            if (fd != input && fd != tee_output && fd != splice_output && close(fd) < 0) {
+                perror("smash error: close failed");
+            }
+        }
+        relayFanOut(input, tee_output, splice_output);
+        exit(0);
+    } else if (pid < 0) {
+        perror("smash error: fork failed");
+    }
+    return pid;
+}
 
 RedirectionCommand::RedirectionCommand(const char* cmd_line, SmallShell* shell) :   Command(cmd_line),
                                                                                     shell(shell),
-                                                                                    to_append(false),
-                                                                                    to_background(false) {
-    // find split place
-    int split_place = original_cmd.find_first_of(">");
-
-    // check if need to append
-    if (cmd_line[split_place+1] == '>') to_append = true;
+                                                                                    to_background(false),
+                                                                                    invalid_args(false) {
+    LineString line = original_cmd;
+    if (checkAndRemoveAmpersand(line)) to_background = true;
+
+    // take every redirection out of the line, the rest is the command
+    size_t position = 0;    // where the command continues
+    size_t op;
+    while ((op = line.find_first_of("<>", position)) != LineString::npos) {
+        Redirection redirection = {STDOUT, -1, 0, LineString()};
+
+        // the fd it sets: a number right before the operator, "&" for both outputs, or the default
+        size_t start = op;
+        while (start > position && isdigit(line[start - 1])) start--;
+        if (start > 0 && !isspace(line[start - 1])) start = op;   // like "a2>", a part of a word
+        if (start < op) {
+            redirection.fd = atoi(line.c_str() + start);
+        } else if (line[op] == '>' && op > position && line[op - 1] == '&') {
+            redirection.fd = REDIRECT_BOTH;
+            start--;
+        } else if (line[op] == '<') {
+            redirection.fd = STDIN;
+        }
 
-    // save command part
-    cmd_part = _trim(original_cmd.substr(0, split_place));
+        size_t next = op + 1;
+        bool duplicate = false;
+        if (line[op] == '<') {
+            redirection.flags = O_RDONLY;
+        } else if (line[next] == '>') {
+            redirection.flags = O_WRONLY | O_CREAT | O_APPEND;
+            next++;
+        } else if (line[next] == '&') {
+            duplicate = true;
+            next++;
+        } else {
+            redirection.flags = O_WRONLY | O_CREAT | O_TRUNC;
+        }
 
-    // and file address part
-    if (to_append) split_place++;
-    pathname = _trim(original_cmd.substr(split_place+1));
+        // the word after it is the file (or the fd to copy)
+        next = std::min(line.find_first_not_of(WHITESPACE.c_str(), next), line.size());
+        size_t word_end = std::min(line.find_first_of((WHITESPACE + "<>").c_str(), next), line.size());
+        LineString word = line.substr(next, word_end - next);
+        if (duplicate) {
+            if (word.empty() || word.find_first_not_of("0123456789") != LineString::npos ||
+                redirection.fd == REDIRECT_BOTH) {
+                invalid_args = true;
+            } else {
+                redirection.source = atoi(word.c_str());
+            }
+        } else if (word.empty()) {
+            invalid_args = true;
+        } else {
+            redirection.pathname = word;
+        }
+        redirections.push_back(redirection);
 
-    // move ampersand from pathname to cmd_part if there is one
-    if (checkAndRemoveAmpersand(pathname)) to_background = true;
+        cmd_part += line.substr(position, start - position);
+        position = word_end;
+    }
+    cmd_part = _trim(cmd_part + line.substr(position));
 
-    // get first argument and ignore everything after it
-    int end_of_pathname = pathname.find_first_of(" ");
-    pathname = pathname.substr(0,end_of_pathname);
+    if (invalid_args) {
+        printError("redirection: invalid arguments");
+        return;
+    }
 
     // check if cmd is built-in command
-    cmd_is_built_in = isBuiltInCommand(cmd_part);
+    cmd_is_built_in = isBuiltInCommand(cmd_part.c_str());
+    cmd_is_external = isExternalCommand(cmd_part.c_str());
 }
-void RedirectionCommand::execute() {
+bool RedirectionCommand::openFiles(SpawnAttributes& attr, vector<int>& files) {
+    mode_t mode = S_IRWXU | S_IRWXG | S_IRWXO;
+    for (const Redirection& redirection : redirections) {
+        if (redirection.source >= 0) {  // "N>&M"
+            attr.addDup2(redirection.source, redirection.fd);
+            continue;
+        }
 
-    // open file, if to_append is true open in append mode
-    int flags = O_CREAT | O_WRONLY;
-    if (to_append) {
-        flags |= O_APPEND;
-    } else {
-        flags |= O_TRUNC;
+        int file_fd = open(redirection.pathname.c_str(), redirection.flags | O_CLOEXEC, mode);
+        if (file_fd < 0) { // can't continue
+            perror("smash error: open failed");
+            LAST_STATUS = 1;
+            for (int fd : files) {
+                if (close(fd) < 0) perror("smash error: close failed");
+            }
+            files.clear();
+            return false;
+        }
+        files.push_back(file_fd);
+
+        if (redirection.fd == REDIRECT_BOTH) {
+            attr.addDup2(file_fd, STDOUT);
+            attr.addDup2(file_fd, STDERR);
+        } else {
+            attr.addDup2(file_fd, redirection.fd);
+        }
     }
-    mode_t mode = S_IRWXU | S_IRWXG | S_IRWXO;
-    int file_fd = open(pathname.c_str(), flags, mode);
-    if (file_fd < 0) { // can't continue
-        perror("smash error: open failed");
-        return;
+    return true;
+}
+pid_t RedirectionCommand::spawn(SpawnAttributes attr) {
+    vector<int> files;
+    if (!openFiles(attr, files)) return -1;
+
+    // the exec'd process itself gets the files, smash doesn't fork for them
+    ExternalCommand cmd(cmd_part.c_str(), nullptr);
+    pid_t pid = cmd.spawn(attr);
+    if (pid < 0) {
+        perror("smash error: posix_spawn failed");
+        LAST_STATUS = 127;
     }
 
+    for (int fd : files) {
+        if (close(fd) < 0) perror("smash error: close failed");
+    }
+    return pid;
+}
+void RedirectionCommand::execute() {
+    if (invalid_args) return;
+
     if (cmd_is_built_in) {
-        // save old stdout
-        auto stdout_fd = dup(STDOUT);
-        if (stdout_fd < 0) { // dup error - can't continue
-            perror("smash error: dup failed");
-            if (close(file_fd) < 0) perror("smash error: close failed");
-            return;
-        }
-        // change stdout to given FD
-        if (dup2(file_fd, STDOUT) < 0) { // dup2 error - can't continue
-            perror("smash error: dup2 failed");
-            if (close(stdout_fd) < 0) perror("smash error: close failed");
-            if (close(file_fd) < 0) perror("smash error: close failed");
-            return;
+        SpawnAttributes attr;
+        vector<int> files;
+        if (!openFiles(attr, files)) return;
+
+        // set smash's own fds, saving the old ones (-1 if it was closed)
+        vector<std::pair<int, int>> saved;
+        bool redirected = true;
+        for (const SpawnFileAction& action : attr.file_actions) {
+            bool is_saved = false;
+            for (const auto& old : saved) is_saved = is_saved || old.first == action.new_fd;
+            if (!is_saved) saved.emplace_back(action.new_fd, fcntl(action.new_fd, F_DUPFD_CLOEXEC, 10));
+            if (dup2(action.fd, action.new_fd) < 0) { // dup2 error - can't continue
+                perror("smash error: dup2 failed");
+                redirected = false;
+                break;
+            }
         }
 
         // execute the fg command
-        shell->executeCommand(cmd_part.c_str());
-
-        // revert stdout back to old stdout
-        if (dup2(stdout_fd, STDOUT) < 0) perror("smash error: dup2 failed");
-        if (close(stdout_fd) < 0) perror("smash error: close failed");
-        if (close(file_fd) < 0) perror("smash error: close failed");
+        if (redirected) shell->executeCommand(cmd_part.c_str());
+
+        // revert the fds back to the old ones, the first saved is the oldest
+        std::cout << std::flush;
+        for (auto old = saved.rbegin(); old != saved.rend(); old++) {
+            if (old->second < 0) {
+                close(old->first);
+                continue;
+            }
+            if (dup2(old->second, old->first) < 0) perror("smash error: dup2 failed");
+            if (close(old->second) < 0) perror("smash error: close failed");
+        }
+        for (int fd : files) {
+            if (close(fd) < 0) perror("smash error: close failed");
+        }
         return;
     }
 
-    pid_t pid = fork();
-
-    if (pid == 0) { // child
-        if (isSmashChild()) setpgrp();  // make sure that the child get different GROUP ID
-
-        // put file descriptor in STDOUT place
-        if (dup2(file_fd, STDOUT) < 0) {  // dup2 error - can't continue
-            perror("smash error: dup2 failed");
-            if (close(file_fd) < 0) perror("smash error: close failed");
+    pid_t pid;
+    if (cmd_is_external) {
+        pid = spawn(childAttributes());     // the child gets a different GROUP ID
+        if (pid < 0) return;
+    } else {
+        // cp forks on its own, so a fork of smash with the redirections runs it
+        SpawnAttributes attr = childAttributes();
+        vector<int> files;
+        if (!openFiles(attr, files)) return;
+
+        pid = spawnFork(attr);
+        if (pid == 0) { // child
+            shell->executeCommand(cmd_part.c_str());
             exit(0);
         }
+        for (int fd : files) {
+            if (close(fd) < 0) perror("smash error: close failed");
+        }
+        if (pid < 0) {
+            perror("smash error: fork failed");
+            return;
+        }
+    }
 
-        shell->executeCommand(cmd_part.c_str());
-
-        if (close(file_fd) < 0) perror("smash error: close failed");
-        exit(0);
-
-    } else if (pid > 0) { // parent
-        if (childWait(pid)) return;
-
-        if (to_background) {    // run in background
-            // if with "&" add to JOBS LIST and return
-            shell->addJob(pid, original_cmd);
-        } else {                // run in foreground
-            CURR_FORK_CHILD_RUNNING = pid;
-            int status;
+    // parent
+    if (childWait(pid)) return;
 
-            // wait for job
-            if (waitpid(pid, &status, WUNTRACED) < 0) {
-                perror("smash error: waitpid failed");
-            } else {
-                // add to jobs list if stopped
-                if (WIFSTOPPED(status)) shell->addJob(pid, original_cmd, true);
-            }
-            CURR_FORK_CHILD_RUNNING = 0;
+    if (to_background) {    // run in background
+        // if with "&" add to JOBS LIST and return
+        shell->addJob(pid, original_cmd.c_str());
+    } else {                // run in foreground
+        // wait for job, add to jobs list if stopped
+        unsigned int processes = 1;
+        JobUsage usage;
+        if (waitForeground(pid, &processes, &usage)) {
+            shell->addJob(pid, original_cmd.c_str(), true)->usage = usage;
         }
-    } else {
-        perror("smash error: fork failed");
     }
 }
 
@@ -528,29 +1123,31 @@ TimeoutCommand::TimeoutCommand(const char* cmd_line, SmallShell* shell) :   Comm
 
     //parsing
     string tmp;
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
+    CommandTokens args(cmd_line);
+    int num_of_args = args.size();
     if (num_of_args > 2) {
-        bool is_num = true;
+        // seconds, optionally with a fraction (like 0.25)
+        bool is_num = isdigit(args[1][0]);
+        bool seen_point = false;
         for (int digit = 0; args[1][digit]; digit++) {
-            if (!isdigit(args[1][digit])) is_num = false;
+            if (args[1][digit] == '.' && !seen_point) seen_point = true;
+            else if (!isdigit(args[1][digit])) is_num = false;
         }
 
         if (is_num) {
-            duration = stoi(args[1]);
+            duration = strtod(args[1], nullptr);
         }
 
-        if (!is_num || (is_num && duration < 1)) {
+        if (!is_num || (is_num && duration < 0.001)) {
             printError("timeout: invalid arguments");
             // duration = 0 so execute() will do nothing
         }
 
         for (int i = 2; i < num_of_args; i++) {
-            cmd_part += string(args[i]);
+            cmd_part += args[i];
             cmd_part += " ";
         }
     }
-    for (int i = 0; i < num_of_args; i++) free(args[i]);
     if (num_of_args < 3) {  // too few arguments
         printError("timeout: invalid arguments");
         return;
@@ -561,15 +1158,15 @@ TimeoutCommand::TimeoutCommand(const char* cmd_line, SmallShell* shell) :   Comm
     to_background = checkAndRemoveAmpersand(cmd_part);
 
     // check if it's built-in command
-    cmd_is_built_in = isBuiltInCommand(cmd_part);
+    cmd_is_built_in = isBuiltInCommand(cmd_part.c_str());
 }
 void TimeoutCommand::execute() {
     if (cmd_part.empty()) return;  // no command to execute
-    if (duration < 1) return;      // invalid duration given
+    if (duration < 0.001) return;  // invalid duration given
 
     if (cmd_is_built_in) {
         // print alarm even if the job finishes before
-        updateAlarm(duration);
+        addTimer(duration, 0);
 
         // fg won't be tested, and every other built-in command is too short to be timed out
         // so just execute the command
@@ -577,44 +1174,34 @@ void TimeoutCommand::execute() {
         return;
     }
 
-    pid_t pid = fork();
+    pid_t pid = spawnFork(childAttributes());   // the child gets a different GROUP ID
 
     if (pid == 0) { // child
-        if (isSmashChild()) setpgrp();  // make sure that the child get different GROUP ID
-
         shell->executeCommand(cmd_part.c_str());
         exit(0);
 
     } else if (pid > 0) { // parent
 
         // add the timeout command to the jobs list as a timeout job
-        JobEntry* job_entry = shell->addJob(pid, original_cmd, false, true, duration);
+        JobEntry* job_entry = shell->addJob(pid, original_cmd.c_str(), false, true);
 
-       // update alarm
-       updateAlarm(duration);
+        // start the job's timer
+        job_entry->timer = addTimer(duration, pid);
 
         if (!to_background) {
-            CURR_FORK_CHILD_RUNNING = pid;
-            int status;
-
             // wait for job
-            if (waitpid(pid, &status, WUNTRACED) < 0) {
-                perror("smash error: waitpid failed");
+            if (waitForeground(pid, &job_entry->processes, &job_entry->usage)) {
+                // set as stopped if stopped
+                // (it's already in jobs list)
+                job_entry->is_stopped = true;
+
+                // reset the job's timer
+                // (this is when it's supposed to have been added to the job's list)
+                job_entry->SetTime();
             } else {
-                if (WIFSTOPPED(status)) {
-                    // set as stopped if stopped
-                    // (it's already in jobs list)
-                    job_entry->is_stopped = true;
-
-                    // reset the job's timer
-                    // (this is when it's supposed to have been added to the job's list)
-                    job_entry->SetTime();
-                } else {
-                    // finished -> set to remove from jobs list
-                    job_entry->pid = 0;
-                }
+                // finished -> remove from jobs list
+                shell->removeJob(pid);
             }
-            CURR_FORK_CHILD_RUNNING = 0;
         }
     } else {
         perror("smash error: fork failed");
@@ -622,50 +1209,197 @@ void TimeoutCommand::execute() {
 }
 
 
+ChainCommand::ChainCommand(const char* cmd_line, SmallShell* shell) :   Command(cmd_line),
+                                                                        shell(shell),
+                                                                        invalid_args(false) {
+    // split at every operator, each command keeps its own "&"
+    const char* command = cmd_line;
+    const char* op;
+    while ((op = findChainOperator(command)) != nullptr) {
+        commands.push_back(_trim(LineString(command, op - command)));
+        operators.push_back(*op);
+        command = op + (*op == ';' ? 1 : 2);
+    }
+    commands.push_back(_trim(LineString(command)));
+
+    // only the last command may be empty, after a ";"
+    for (unsigned int i = 0; i < commands.size(); i++) {
+        bool last = i + 1 == commands.size();
+        if (commands[i].empty() && !(last && operators.back() == ';')) invalid_args = true;
+    }
+    if (invalid_args) printError("chain: invalid arguments");
+}
+void ChainCommand::execute() {
+    if (invalid_args) return;
+
+    for (unsigned int i = 0; i < commands.size() && !QUIT_SHELL; i++) {
+        // "&&" runs the next command if this one succeeded, "||" if it failed, the status
+        // stays the one of the last command that ran ("false && a || b" runs b)
+        if (i > 0 && operators[i - 1] == '&' && LAST_STATUS != 0) continue;
+        if (i > 0 && operators[i - 1] == '|' && LAST_STATUS == 0) continue;
+        if (commands[i].empty()) break;
+
+        LAST_STATUS = 0;
+        shell->executeCommand(commands[i].c_str());
+
+        // ctrl-C or ctrl-Z on a command ends the whole list
+        if (LAST_STATUS == 128 + SIGINT || LAST_STATUS == 128 + SIGTSTP) break;
+    }
+}
+
+TimeCommand::TimeCommand(const char* cmd_line, SmallShell* shell) : Command(cmd_line),
+                                                                    shell(shell) {
+    // everything after "time"
+    cmd_part = _trim(LineString(cmd_line));
+    size_t name_end = cmd_part.find_first_of(WHITESPACE.c_str());
+    cmd_part = (name_end == LineString::npos) ? LineString() : _trim(cmd_part.substr(name_end));
+
+    // it's waited for anyway, so it runs in the foreground
+    checkAndRemoveAmpersand(cmd_part);
+    if (cmd_part.empty()) printError("time: invalid arguments");
+}
+void TimeCommand::execute() {
+    if (cmd_part.empty()) return;  // no command to execute
+
+    // the processes are measured by waitForeground, built-in commands by smash's own usage
+    // (in a stage of a pipeline childWait reaps the processes, they're its children's usage)
+    struct rusage self_before, self_after, children_before, children_after;
+    bool in_stage = !isSmash();
+    if (getrusage(RUSAGE_SELF, &self_before) < 0) perror("smash error: getrusage failed");
+    if (in_stage && getrusage(RUSAGE_CHILDREN, &children_before) < 0) perror("smash error: getrusage failed");
+    JobUsage usage;
+    PhaseTimes phases;
+    JobUsage* outer_usage = TIMED_USAGE;
+    PhaseTimes* outer_phases = MEASURED_PHASES;
+    TIMED_USAGE = &usage;
+    MEASURED_PHASES = &phases;
+
+    shell->executeCommand(cmd_part.c_str());
+
+    int64_t real_time = monotonicNow() - usage.started;
+    TIMED_USAGE = outer_usage;
+    MEASURED_PHASES = outer_phases;
+    if (outer_usage != nullptr) outer_usage->merge(usage);    // "time time ..."
+    if (outer_phases != nullptr) outer_phases->merge(phases);
+    if (getrusage(RUSAGE_SELF, &self_after) < 0) perror("smash error: getrusage failed");
+
+    struct timeval self_time;
+    timersub(&self_after.ru_utime, &self_before.ru_utime, &self_time);
+    timeradd(&usage.user_time, &self_time, &usage.user_time);
+    timersub(&self_after.ru_stime, &self_before.ru_stime, &self_time);
+    timeradd(&usage.system_time, &self_time, &usage.system_time);
+    usage.voluntary_switches += self_after.ru_nvcsw - self_before.ru_nvcsw;
+    usage.involuntary_switches += self_after.ru_nivcsw - self_before.ru_nivcsw;
+    if (usage.exited == 0) usage.max_rss = self_after.ru_maxrss;    // only smash ran
+    if (in_stage && getrusage(RUSAGE_CHILDREN, &children_after) == 0) {
+        timersub(&children_after.ru_utime, &children_before.ru_utime, &self_time);
+        timeradd(&usage.user_time, &self_time, &usage.user_time);
+        timersub(&children_after.ru_stime, &children_before.ru_stime, &self_time);
+        timeradd(&usage.system_time, &self_time, &usage.system_time);
+        usage.max_rss = std::max(usage.max_rss, children_after.ru_maxrss);
+        usage.voluntary_switches += children_after.ru_nvcsw - children_before.ru_nvcsw;
+        usage.involuntary_switches += children_after.ru_nivcsw - children_before.ru_nivcsw;
+    } else if (in_stage) {
+        perror("smash error: getrusage failed");
+    }
+
+    cerr << "smash: time: " << formatUsage(usage, real_time) << endl;
+
+    // what smash spent of the real time, by phase (the count is shown when a phase repeated)
+    int64_t overhead = 0;
+    cerr << "smash: time: overhead";
+    cerr << std::fixed << std::setprecision(1);
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        if (phase == PHASE_WAIT) continue;  // the command's own time
+        overhead += phases.total[phase];
+        cerr << " " << PHASE_NAMES[phase] << "=" << phases.total[phase] / 1e3 << "us";
+        if (phases.count[phase] > 1) cerr << "(" << phases.count[phase] << ")";
+    }
+    cerr << " total=" << overhead / 1e3 << "us";
+    if (real_time > 0) cerr << std::setprecision(2) << " (" << 100.0 * overhead / real_time << "% of real)";
+    cerr << std::defaultfloat << endl;
+}
+
 //---------------------------EXTERNAL CLASS------------------------------
 ExternalCommand::ExternalCommand(const char* cmd_line, JobsList* jobs) :    Command(cmd_line),
                                                                             cmd_to_son(cmd_line),
                                                                             jobs(jobs),
-                                                                            to_background(false) {
+                                                                            to_background(false),
+                                                                            direct_exec(false) {
     if (checkAndRemoveAmpersand(cmd_to_son)) to_background = true;
+
+    // commands with special characters are left for bash
+    if (cmd_to_son.find_first_of(BASH_SPECIAL_CHARS.c_str()) != LineString::npos) return;
+
+    CommandTokens args(cmd_to_son.c_str());
+    int num_of_args = args.size();
+    exec_args.assign(args.argv(), args.argv() + num_of_args);
+
+    // if the binary can't be found, let bash report it the usual way
+    if (num_of_args > 0 && PATH_CACHE.find(exec_args[0].c_str(), exec_path)) direct_exec = true;
 }
 void ExternalCommand::execute() {
-    pid_t pid = fork();
-
-    if (pid == 0) { //child:
-        if (isSmashChild()) setpgrp();  // make sure that the child get different GROUP ID
+    // the child gets a different GROUP ID
+    pid_t pid = spawn(childAttributes());
 
-        // exec to bash with cmd_line
-        string arg1 = "-c";
-        if (execl("/bin/bash", "/bin/bash", arg1.c_str(), cmd_to_son.c_str(), (char*) nullptr) < 0) {
-            perror("smash error: execl failed");
-        }
-        exit(0);    // child finished (if execl failed)
-    }
-    else if (pid > 0) { //parent
+    if (pid > 0) { //parent
         if (childWait(pid)) return;
 
         if (to_background) {    // run in background
             // if with "&" add to JOBS LIST and return
-            jobs->addJob(pid, original_cmd);
+            jobs->addJob(pid, original_cmd.c_str());
         } else {                // run in foreground
-
-            CURR_FORK_CHILD_RUNNING = pid;
-            int status;
-
-            // wait for job
-            if (waitpid(pid, &status, WUNTRACED) < 0) {
-                perror("smash error: waitpid failed");
-            } else {
-                // add to jobs list if stopped
-                if (WIFSTOPPED(status)) jobs->addJob(pid, original_cmd, true);
+            // wait for job, add to jobs list if stopped
+            unsigned int processes = 1;
+            JobUsage usage;
+            if (waitForeground(pid, &processes, &usage)) {
+                jobs->addJob(pid, original_cmd.c_str(), true)->usage = usage;
             }
-            CURR_FORK_CHILD_RUNNING = 0;
         }
     }
-    else { // fork failed
-        perror("smash error: fork failed");
+    else { // spawn failed
+        perror("smash error: posix_spawn failed");
+        LAST_STATUS = 127;
+    }
+}
+pid_t ExternalCommand::spawn(const SpawnAttributes& attr) {
+    LineVector<char*> argv;
+    const char* path;
+    if (direct_exec) {
+        // exec the binary directly
+        for (auto& arg : exec_args) argv.push_back(&arg[0]);
+        DIRECT_EXEC_COUNT++;
+        path = exec_path.c_str();
+    } else {
+        // exec to bash with cmd_line
+        argv.push_back(const_cast<char*>("/bin/bash"));
+        argv.push_back(const_cast<char*>("-c"));
+        argv.push_back(&cmd_to_son[0]);
+        BASH_EXEC_COUNT++;
+        path = "/bin/bash";
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = spawnExec(path, argv.data(), attr);
+    if (pid < 0 && direct_exec && errno == ENOENT) {
+        // its binary may have been removed since it was found: launch it from where it is now,
+        // or let bash report it (the same path again means ENOENT came from somewhere else)
+        string old_path = exec_path;
+        PATH_CACHE.forget(exec_args[0].c_str());
+        direct_exec = PATH_CACHE.find(exec_args[0].c_str(), exec_path);
+        if (!direct_exec || exec_path != old_path) {
+            DIRECT_EXEC_COUNT--;
+            return spawn(attr);
+        }
+        errno = ENOENT;
+    } else if (pid < 0 && direct_exec && (errno == ENOEXEC || errno == EACCES)) {
+        // a script without "#!" is run by bash, and bash reports what can't be run the usual way
+        // (like "Is a directory")
+        DIRECT_EXEC_COUNT--;
+        direct_exec = false;
+        return spawn(attr);
     }
+    return pid;
 }
 
 //---------------------------BUILT IN CLASSES------------------------------
@@ -674,11 +1408,9 @@ ChangePromptCommand::ChangePromptCommand(const char* cmd_line, SmallShell* shell
                                                                                     prompt("smash") {
     // no argument = change to default prompt "smash"
     // otherwise, get the new prompt text
-    string tmp;
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
-    if (num_of_args > 1) tmp = args[1]; // save prompt string
-    for (int i = 0; i < num_of_args; i++) free(args[i]);
+    LineString tmp;
+    CommandTokens args(cmd_line);
+    if (args.size() > 1) tmp = args[1]; // save prompt string
 
     // remove ampersand
     checkAndRemoveAmpersand(tmp);
@@ -686,7 +1418,7 @@ ChangePromptCommand::ChangePromptCommand(const char* cmd_line, SmallShell* shell
 }
 void ChangePromptCommand::execute() {
     // change shell prompt
-    shell->changePrompt(prompt);
+    shell->changePrompt(prompt.c_str());
 }
 
 void ShowPidCommand::execute() {
@@ -694,6 +1426,24 @@ void ShowPidCommand::execute() {
     std::cout << "smash pid is " << SMASH_PROCESS_PID << endl;
 }
 
+void StatsCommand::execute() {
+#ifdef SMASH_TRACE
+    std::cout << "smash: latency of each stage, per command class:" << endl;
+    printTraceStats(std::cout);
+#else
+    printError("stats: smash was built without tracing (make TRACE=1)");
+#endif
+}
+
+void ExecStatsCommand::execute() {
+    // print how external commands were launched
+    std::cout << "smash: direct exec: " << DIRECT_EXEC_COUNT << ", bash exec: " << BASH_EXEC_COUNT << endl;
+    LINE_CACHE.printStats(std::cout);
+#ifdef SMASH_ALLOC_STATS
+    std::cout << "smash: heap allocations: " << HEAP_ALLOCATIONS << endl;
+#endif
+}
+
 void GetCurrDirCommand::execute() {
     char* dir = getcwd(nullptr, COMMAND_MAX_CHARS + 1);
     if (!dir) {
@@ -707,16 +1457,14 @@ void GetCurrDirCommand::execute() {
 ChangeDirCommand::ChangeDirCommand(const char* cmd_line, string* last_dir) : BuiltInCommand(cmd_line),
                                                                              old_pwd(last_dir),
                                                                              new_path("") {
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
+    CommandTokens args(cmd_line);
+    int num_of_args = args.size();
 
     if (num_of_args > 2) { // more than one argument
         printError("cd: too many arguments");
     } else if (num_of_args == 2) {
         new_path = args[1];
     } // else new_path = "";  // command is "cd" without arguments
-
-    for (int i = 0; i < num_of_args; i++) free(args[i]);
 }
 void ChangeDirCommand::execute() {
     // get current directory to save after
@@ -752,14 +1500,67 @@ void ChangeDirCommand::execute() {
     } else if (retVAl == -1) {
         // directory change error
         perror("smash error: chdir failed");
+        LAST_STATUS = 1;
     } // else do nothing
 }
 
+HashCommand::HashCommand(const char* cmd_line) : BuiltInCommand(cmd_line),
+                                                 reset(false) {
+    CommandTokens args(cmd_line);
+    for (int i = 1; i < args.size(); i++) {
+        LineString name = args[i];
+        checkAndRemoveAmpersand(name);
+        if (name == "-r") reset = true;
+        else if (!name.empty()) names.push_back(name);
+    }
+}
+void HashCommand::execute() {
+    if (reset) PATH_CACHE.clear();
+
+    // "hash name..." looks the commands up now, so they're found later without a search
+    string full_path;
+    for (const auto& name : names) {
+        if (findBuiltin(name.c_str()) != nullptr) continue;
+        if (!PATH_CACHE.find(name.c_str(), full_path)) printError("hash: " + string(name.c_str()) + ": not found");
+    }
+
+    if (!reset && names.empty() && !PATH_CACHE.print(std::cout)) std::cout << "smash: hash table empty" << endl;
+}
+
+TypeCommand::TypeCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {
+    CommandTokens args(cmd_line);
+    for (int i = 1; i < args.size(); i++) {
+        LineString name = args[i];
+        checkAndRemoveAmpersand(name);
+        if (!name.empty()) names.push_back(name);
+    }
+}
+void TypeCommand::execute() {
+    for (const auto& name : names) {
+        // the way smash would run it: built-in commands first, then PATH
+        string full_path;
+        const string* cached = PATH_CACHE.cached(name.c_str());
+        if (findBuiltin(name.c_str()) != nullptr) {
+            std::cout << name << " is a shell builtin" << endl;
+        } else if (cached != nullptr) {
+            std::cout << name << " is hashed (" << *cached << ")" << endl;
+        } else if (PATH_CACHE.find(name.c_str(), full_path)) {
+            std::cout << name << " is " << full_path << endl;
+        } else {
+            printError("type: " + string(name.c_str()) + ": not found");
+        }
+    }
+}
+
 JobsCommand::JobsCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(cmd_line),
-                                                                 jobs(jobs) {
+                                                                 jobs(jobs),
+                                                                 long_format(false) {
+    // "jobs -l" also prints the resources of each job, other arguments are ignored
+    CommandTokens args(cmd_line);
+    long_format = args.size() > 1 && strcmp(args[1], "-l") == 0;
 }
 void JobsCommand::execute() {
-    jobs->printJobsList();
+    jobs->printJobsList(long_format);
 }
 
 KillCommand::KillCommand(const char* cmd_line, JobsList* jobs) :    BuiltInCommand(cmd_line),
@@ -784,14 +1585,13 @@ KillCommand::KillCommand(const char* cmd_line, JobsList* jobs) :    BuiltInComma
 void KillCommand::execute() {
     if (job_id == 0 || signum == 0 || !job_entry) return;
 
-    pid_t gpid = getpgid(job_entry->pid);
-    if (gpid < 0) {
-        perror("smash error: getgpid failed");
+    if (job_entry->is_queued) {   // no process to signal yet
+        printError("kill: job-id " + to_string(job_id) + " is queued");
         return;
     }
 
-    // send signal to the process group
-    if (killpg(gpid, signum) < 0) { // can't continue
+    // send signal to the process group (every job leads its own group)
+    if (killpg(job_entry->pid, signum) < 0) { // can't continue
         perror("smash error: killpg failed");
         return;
     }
@@ -809,13 +1609,12 @@ bool KillCommand::parseAndCheck(const char* cmd_line, int* sig, JobID* j_id) {
     string first_arg, second_arg;
 
     // parse
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
+    CommandTokens args(cmd_line);
+    int num_of_args = args.size();
     if (num_of_args == 3) {
         first_arg = args[1];
         second_arg = args[2];
     }
-    for (int i = 0; i < num_of_args; i++) free(args[i]);
     if (num_of_args != 3) return false;
 
     // check first argument
@@ -891,45 +1690,36 @@ void ForegroundCommand::execute() {
     pid_t pid = job_entry->pid;
     string cmd_str = job_entry->cmd_str;
 
+    if (job_entry->is_queued) {     // start it now, in the foreground
+        cout << cmd_str << " : queued" << endl;
+        SmallShell::getInstance().startQueuedJob(job_id, true);
+        return;
+    }
+
     // print job's command line
     cout << cmd_str << " : " << pid << endl;
 
     // update state to not stopped
     job_entry->is_stopped = false;
 
-    // send SIGCONT to job's pid
-    pid_t gpid = getpgid(pid);
-    if (gpid < 0) {
-        perror("smash error: getgpid failed");
-        return;
-    }
-
-    // send signal, print message
-    if (killpg(gpid, SIGCONT) < 0) { // can't continue
+    // send SIGCONT to job's group (every job leads its own group)
+    if (killpg(pid, SIGCONT) < 0) { // can't continue
         perror("smash error: killpg failed");
         return;
     }
 
-    CURR_FORK_CHILD_RUNNING = pid;
-    int status;
-
     // wait for job
-    if (waitpid(pid, &status, WUNTRACED) < 0) {
-        perror("smash error: waitid failed");
-    } else {
-        if (WIFSTOPPED(status)) { // if it gets stopped
-            // reset process' time
-            job_entry->start_time = time(nullptr);
-            if (job_entry->start_time == (time_t)(-1)) perror("smash error: time failed");
+    if (waitForeground(pid, &job_entry->processes, &job_entry->usage)) { // if it gets stopped
+        // reset process' time
+        job_entry->start_time = time(nullptr);
+        if (job_entry->start_time == (time_t)(-1)) perror("smash error: time failed");
 
-            // update 'stopped' status
-            job_entry->is_stopped = true;
+        // update 'stopped' status
+        job_entry->is_stopped = true;
 
-        } else { // if it it finished
-            jobs->removeJobById(job_id);    // remove from jobs list
-        }
+    } else { // if it it finished
+        jobs->removeJobById(job_id);    // remove from jobs list
     }
-    CURR_FORK_CHILD_RUNNING = 0;
 }
 
 void ForegroundCommand::printJobError() {
@@ -964,6 +1754,11 @@ BackgroundCommand::BackgroundCommand(const char* cmd_line, JobsList* jobs) : Bui
             invalid_args = true;
             return;
         }
+        if (job_entry->is_queued) {
+            printError("bg: job-id " + to_string(job_id) + " is queued");
+            invalid_args = true;
+            return;
+        }
         if (!job_entry->is_stopped) {
             printNotStoppedError();
             invalid_args = true;
@@ -985,14 +1780,8 @@ void BackgroundCommand::execute() {
     // send SIGCONT to job's pid
     // update is_stopped
 
-    pid_t gpid = getpgid(job_entry->pid);
-    if (gpid < 0) {
-        perror("smash error: getgpid failed");
-        return;
-    }
-
-    // send signal, print message
-    if (killpg(gpid, SIGCONT) < 0) {
+    // send signal to the job's group (every job leads its own group)
+    if (killpg(job_entry->pid, SIGCONT) < 0) {
         // can't continue
         perror("smash error: killpg failed");
         return;
@@ -1022,10 +1811,9 @@ void parseAndCheckFgBgCommands(const char* cmd_line, JobID& job_id, bool& no_arg
     invalid_args = false;
 
     // parse
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
+    CommandTokens args(cmd_line);
+    int num_of_args = args.size();
     if (num_of_args == 2) arg = args[1];
-    for (int i = 0; i < num_of_args; i++) free(args[i]);
 
     if (num_of_args > 2) {
         invalid_args = true;
@@ -1055,11 +1843,9 @@ QuitCommand::QuitCommand(const char* cmd_line, JobsList* jobs) :    BuiltInComma
                                                                     kill_all(false),
                                                                     jobs(jobs) {
     // parse
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
-    for (int i = 0; i < num_of_args; i++) {
-        if (i > 0 && string(args[i]) == "kill") kill_all = true;
-        free(args[i]);
+    CommandTokens args(cmd_line);
+    for (int i = 1; i < args.size(); i++) {
+        if (strcmp(args[i], "kill") == 0) kill_all = true;
     }
 }
 void QuitCommand::execute() {
@@ -1071,18 +1857,45 @@ CopyCommand::CopyCommand(const char* cmd_line, JobsList* jobs) : BuiltInCommand(
                                                                  old_path(""),
                                                                  new_path(""),
                                                                  background(false),
+                                                                 verbose(false),
+                                                                 invalid_args(false),
+                                                                 threads(1),
                                                                  jobs(jobs) {
-    char* args[COMMAND_MAX_ARGS+1];
-    int num_of_args = _parseCommandLine(cmd_line, args);
-    if (num_of_args > 2) {
-        old_path = args[1];
-        new_path = args[2];
+    CommandTokens args(cmd_line);
+    int num_of_args = args.size();
+
+    // options come before the paths
+    int first_path = 1;
+    for (; first_path < num_of_args && args[first_path][0] == '-'; first_path++) {
+        string option(args[first_path]);
+        if (option == "-v") {
+            verbose = true;
+        } else if (option == "-j" && first_path + 1 < num_of_args) {
+            // number of threads
+            string num(args[++first_path]);
+            if (num.empty() || num.size() > 2 || num.find_first_not_of("0123456789") != string::npos) {
+                invalid_args = true;
+            } else {
+                threads = stoi(num);
+                if (threads < 1 || threads > COPY_MAX_THREADS) invalid_args = true;
+            }
+        } else {
+            invalid_args = true;
+        }
+    }
+
+    if (num_of_args - first_path > 1) {
+        old_path = args[first_path];
+        new_path = args[first_path + 1];
         if (checkAndRemoveAmpersand(new_path)) background = true;
     }
     if (*args[num_of_args-1] == '&') background = true;
-    for (int i = 0; i < num_of_args; i++) free(args[i]);
+
+    if (invalid_args) printError("cp: invalid arguments");
 }
 void CopyCommand::execute() {
+    if (invalid_args) return;
+
     // too few arguments or empty string given as an argument
     if (old_path.empty() || new_path.empty()) return;
 
@@ -1094,21 +1907,34 @@ void CopyCommand::execute() {
 
     // open the files using helper function
     int fd_read, fd_write;
-    if (!openFiles(&fd_read, &fd_write)) return;
+    if (!openFiles(&fd_read, &fd_write)) {
+        LAST_STATUS = 1;
+        return;
+    }
 
-    pid_t pid = fork();
+    // the child gets a different GROUP ID and default signal handlers,
+    // so copying will stop if SIGTSTP is received
+    int retVal = 0;
+    pid_t pid = spawnFork(childAttributes());
     if (pid == 0) { // copy data in child process
-        if (isSmashChild()) setpgrp();  // make sure that the child get different GROUP ID
-
-        // copying will stop if SIGTSTP is received
-        if (signal(SIGTSTP, SIG_DFL) == SIG_ERR){
-            perror("smash error: failed to set SIGTSTP handler");
+        // Copy the data using helper function
+        CopyMethod method;
+        if (threads > 1) retVal = copyDataParallel(fd_read, fd_write, &method);
+        if (retVal == 0) {  // sequential copy
+            threads = 1;
+            retVal = copyData(fd_read, fd_write, &method) ? 1 : -1;
         }
 
-        // Copy the data using helper function
-        if (copyData(fd_read, fd_write, COPY_DATA_BUFFER_SIZE)) {
+        if (retVal == 1) {
             // on success, print the required message
             cout << "smash: " << old_path << " was copied to " << new_path << endl;
+
+            if (verbose) {
+                const char* names[] = {"reflink", "copy_file_range", "sendfile", "buffer"};
+                cout << "smash: cp used " << names[method];
+                if (threads > 1) cout << " with " << threads << " threads";
+                cout << endl;
+            }
         }
 
     } else if (pid < 1) perror("smash error: fork failed");
@@ -1117,30 +1943,27 @@ void CopyCommand::execute() {
     if (close(fd_read) == -1) perror("smash error: close failed");
     if (close(fd_write) == -1) perror("smash error: close failed");
 
-    if (pid == 0) exit(0);  // child process finished
+    if (pid == 0) exit(retVal == 1 ? 0 : 1);  // child process finished, its status is the one of cp
 
     // only parent process continues from here
 
-    if (pid < 1) return;    // fork failed, parent process returns
+    if (pid < 1) {    // fork failed, parent process returns
+        LAST_STATUS = 1;
+        return;
+    }
 
     if (childWait(pid)) return;
 
     if (background)     // run in background
         // & was given - add to jobs list
-        jobs->addJob(pid, original_cmd);
+        jobs->addJob(pid, original_cmd.c_str());
     else {              // run in foreground
-        int status;
-        CURR_FORK_CHILD_RUNNING = pid;
-
-        // wait for child process
-        if (waitpid(pid, &status, WUNTRACED) < 0) {
-            perror("smash error: waitpid failed");
-        } else if (WIFSTOPPED(status)) {
-            // if stopped add to jobs list
-            jobs->addJob(pid, original_cmd, true);
+        // wait for child process, if stopped add to jobs list
+        unsigned int processes = 1;
+        JobUsage usage;
+        if (waitForeground(pid, &processes, &usage)) {
+            jobs->addJob(pid, original_cmd.c_str(), true)->usage = usage;
         }
-
-        CURR_FORK_CHILD_RUNNING = 0;
     }
 }
 
@@ -1190,37 +2013,316 @@ bool CopyCommand::openFiles(int *fd_read, int *fd_write) {
     return true; // no errors
 }
 
-bool CopyCommand::copyData(int fd_read, int fd_write, int SIZE) {
-    bool retVAl = true;
-    char buff[SIZE];
-    ssize_t read_retVal = read(fd_read, buff, SIZE);
-    ssize_t write_retVal;
-    while (read_retVal > 0) {   // while there is something to write
-        write_retVal = write(fd_write, buff, read_retVal);
-        if (write_retVal == -1) {
-            perror("smash error: write failed");
-            retVAl = false;
+bool CopyCommand::copyData(int fd_read, int fd_write, CopyMethod* method) {
+    // try the methods from the fastest, until one of them is supported
+    int retVal = copyReflink(fd_read, fd_write);
+    *method = COPY_REFLINK;
+    if (retVal == 0) {
+        retVal = copyKernel(fd_read, fd_write, false);
+        *method = COPY_FILE_RANGE;
+    }
+    if (retVal == 0) {
+        retVal = copyKernel(fd_read, fd_write, true);
+        *method = COPY_SENDFILE;
+    }
+    if (retVal == 0) {
+        retVal = copyBuffer(fd_read, fd_write);
+        *method = COPY_BUFFER;
+    }
+
+    return retVal == 1;
+}
+
+int CopyCommand::copyDataParallel(int fd_read, int fd_write, CopyMethod* method) {
+    // only regular files have a size to split into ranges
+    struct stat st;
+    if (fstat(fd_read, &st) == -1) {
+        perror("smash error: fstat failed");
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size <= COPY_PARALLEL_RANGE_SIZE) return 0;
+
+    // a reflink is instant, no need for threads
+    int retVal = copyReflink(fd_read, fd_write);
+    if (retVal != 0) {
+        *method = COPY_REFLINK;
+        threads = 1;
+        return retVal;
+    }
+
+    // allocate the whole destination up front, so the threads don't fight over extending it
+    int alloc_retVal = fallocate(fd_write, 0, 0, st.st_size);
+    if (alloc_retVal != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        perror("smash error: fallocate failed");
+        return -1;
+    }
+
+    // every thread takes the next range until the whole file is copied
+    std::atomic<off_t> next_offset(0);
+    std::atomic<bool> failed(false), used_buffer(false);
+    off_t size = st.st_size;
+    auto worker = [&]() {
+        off_t offset;
+        while (!failed && (offset = next_offset.fetch_add(COPY_PARALLEL_RANGE_SIZE)) < size) {
+            CopyMethod range_method;
+            off_t length = std::min((off_t)COPY_PARALLEL_RANGE_SIZE, size - offset);
+            if (copyRange(fd_read, fd_write, offset, length, &range_method) != 1) failed = true;
+            if (range_method == COPY_BUFFER) used_buffer = true;
+        }
+    };
+
+    vector<std::thread> pool;
+    for (unsigned int i = 0; i < threads; i++) pool.push_back(std::thread(worker));
+    for (auto& thread : pool) thread.join();
+
+    *method = used_buffer ? COPY_BUFFER : COPY_FILE_RANGE;
+    return failed ? -1 : 1;
+}
+
+int CopyCommand::copyRange(int fd_read, int fd_write, off_t offset, off_t length, CopyMethod* method) {
+    // copy_file_range with explicit offsets, so the threads don't share the file positions
+    off_t off_in = offset, off_out = offset, end = offset + length;
+    *method = COPY_FILE_RANGE;
+    while (off_in < end) {
+        ssize_t copied = copy_file_range(fd_read, &off_in, fd_write, &off_out, end - off_in, 0);
+        if (copied > 0) continue;
+        if (copied == 0) return 1;   // the file got shorter
+        if (errno == EINTR) continue;
+
+        if (off_in == offset && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+            // not supported for these files, use pread/pwrite
+            *method = COPY_BUFFER;
+            break;
+        }
+        perror("smash error: copy_file_range failed");
+        return -1;
+    }
+    if (*method == COPY_FILE_RANGE) return 1;
+
+    void* buff;
+    if (posix_memalign(&buff, COPY_DATA_BUFFER_ALIGNMENT, COPY_DATA_BUFFER_SIZE) != 0) {
+        perror("smash error: posix_memalign failed");
+        return -1;
+    }
+
+    int retVal = 1;
+    while (retVal == 1 && off_in < end) {
+        ssize_t read_retVal = pread(fd_read, buff, std::min((off_t)COPY_DATA_BUFFER_SIZE, end - off_in), off_in);
+        if (read_retVal == 0) break;    // the file got shorter
+        if (read_retVal == -1) {
+            if (errno == EINTR) continue;
+            perror("smash error: pread failed");
+            retVal = -1;
+            break;
         }
 
-        // check that the read size equals the write size
-        if (write_retVal != read_retVal) {
-            perror("smash error: incomplete write");
-            retVAl = false;
+        // write everything that was read, even if the write is partial
+        ssize_t written = 0;
+        while (written < read_retVal) {
+            ssize_t write_retVal = pwrite(fd_write, (char*)buff + written, read_retVal - written, off_in + written);
+            if (write_retVal == -1) {
+                if (errno == EINTR) continue;
+                perror("smash error: pwrite failed");
+                retVal = -1;
+                break;
+            }
+            written += write_retVal;
         }
+        off_in += read_retVal;
+    }
+
+    free(buff);
+    return retVal;
+}
+
+int CopyCommand::copyReflink(int fd_read, int fd_write) {
+    if (ioctl(fd_write, FICLONE, fd_read) == 0) return 1;
+
+    // not supported by the file system or across file systems
+    if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL || errno == EPERM) return 0;
 
-        read_retVal = read(fd_read, buff, SIZE);
+    perror("smash error: ioctl failed");
+    return -1;
+}
+
+int CopyCommand::copyKernel(int fd_read, int fd_write, bool use_sendfile) {
+    bool copied_any = false;
+    while (true) {
+        ssize_t copied;
+        if (use_sendfile) {
+            copied = sendfile(fd_write, fd_read, nullptr, COPY_DATA_CHUNK_SIZE);
+        } else {
+            copied = copy_file_range(fd_read, nullptr, fd_write, nullptr, COPY_DATA_CHUNK_SIZE, 0);
+        }
+
+        if (copied == 0) return 1;      // end of file
+        if (copied > 0) {
+            copied_any = true;
+            continue;
+        }
+
+        if (errno == EINTR) continue;
+
+        // the method isn't supported for these files, try the next one
+        if (!copied_any && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) return 0;
+
+        perror(use_sendfile ? "smash error: sendfile failed" : "smash error: copy_file_range failed");
+        return -1;
+    }
+}
+
+int CopyCommand::copyBuffer(int fd_read, int fd_write) {
+    // big aligned buffer, so there are few syscalls and the page cache copies are fast
+    void* buff;
+    if (posix_memalign(&buff, COPY_DATA_BUFFER_ALIGNMENT, COPY_DATA_BUFFER_SIZE) != 0) {
+        perror("smash error: posix_memalign failed");
+        return -1;
     }
 
-    if (read_retVal == -1) {
-        perror("smash error: read failed");
-        retVAl = false;
+    int retVal = 1;
+    ssize_t read_retVal;
+    while ((read_retVal = read(fd_read, buff, COPY_DATA_BUFFER_SIZE)) != 0) {
+        if (read_retVal == -1) {
+            if (errno == EINTR) continue;
+            perror("smash error: read failed");
+            retVal = -1;
+            break;
+        }
+
+        // write everything that was read, even if the write is partial
+        ssize_t written = 0;
+        while (written < read_retVal) {
+            ssize_t write_retVal = write(fd_write, (char*)buff + written, read_retVal - written);
+            if (write_retVal == -1) {
+                if (errno == EINTR) continue;
+                perror("smash error: write failed");
+                retVal = -1;
+                break;
+            }
+            written += write_retVal;
+        }
+        if (retVal == -1) break;
     }
 
-    return retVAl;
+    free(buff);
+    return retVal;
+}
+
+//---------------------------BUILT IN REGISTRY------------------------------
+template <class T>
+Command* createBuiltin(const char* cmd_line, SmallShell* shell) {
+    return new T(cmd_line);
+}
+template <>
+Command* createBuiltin<ChangePromptCommand>(const char* cmd_line, SmallShell* shell) {
+    return new ChangePromptCommand(cmd_line, shell);
+}
+template <>
+Command* createBuiltin<ChainCommand>(const char* cmd_line, SmallShell* shell) {
+    return new ChainCommand(cmd_line, shell);
+}
+template <>
+Command* createBuiltin<PipeCommand>(const char* cmd_line, SmallShell* shell) {
+    return new PipeCommand(cmd_line, shell);
+}
+template <>
+Command* createBuiltin<RedirectionCommand>(const char* cmd_line, SmallShell* shell) {
+    return new RedirectionCommand(cmd_line, shell);
+}
+template <>
+Command* createBuiltin<TimeoutCommand>(const char* cmd_line, SmallShell* shell) {
+    return new TimeoutCommand(cmd_line, shell);
+}
+template <>
+Command* createBuiltin<TimeCommand>(const char* cmd_line, SmallShell* shell) {
+    return new TimeCommand(cmd_line, shell);
+}
+template <>
+Command* createBuiltin<ChangeDirCommand>(const char* cmd_line, SmallShell* shell) {
+    return new ChangeDirCommand(cmd_line, shell->getOldPwd());
+}
+template <class T>
+Command* createJobsBuiltin(const char* cmd_line, SmallShell* shell) {
+    return new T(cmd_line, shell->getJobsList());
+}
+
+constexpr size_t nameLength(const char* name) {
+    return *name ? 1 + nameLength(name + 1) : 0;
+}
+
+#define BUILTIN(name, flags, create) {name, nameLength(name), flags, create}
+
+// every built-in command, in one place
+static constexpr BuiltinEntry BUILTINS[] = {
+    BUILTIN("chprompt", 0, createBuiltin<ChangePromptCommand>),
+    BUILTIN("showpid", BUILTIN_PRINTS, createBuiltin<ShowPidCommand>),
+    BUILTIN("execstats", BUILTIN_PRINTS, createBuiltin<ExecStatsCommand>),
+    BUILTIN("stats", BUILTIN_PRINTS, createBuiltin<StatsCommand>),
+    BUILTIN("hash", BUILTIN_PRINTS, createBuiltin<HashCommand>),
+    BUILTIN("type", BUILTIN_PRINTS, createBuiltin<TypeCommand>),
+    BUILTIN("pwd", BUILTIN_PRINTS, createBuiltin<GetCurrDirCommand>),
+    BUILTIN("cd", 0, createBuiltin<ChangeDirCommand>),
+    BUILTIN("jobs", BUILTIN_PRINTS, createJobsBuiltin<JobsCommand>),
+    BUILTIN("kill", 0, createJobsBuiltin<KillCommand>),
+    BUILTIN("fg", 0, createJobsBuiltin<ForegroundCommand>),
+    BUILTIN("bg", 0, createJobsBuiltin<BackgroundCommand>),
+    BUILTIN("quit", 0, createJobsBuiltin<QuitCommand>),
+    BUILTIN("cp", BUILTIN_FORKS, createJobsBuiltin<CopyCommand>),
+    BUILTIN("timeout", BUILTIN_WRAPS, createBuiltin<TimeoutCommand>),
+    BUILTIN("time", BUILTIN_WRAPS, createBuiltin<TimeCommand>),
+};
+#define BUILTINS_COUNT (int)(sizeof(BUILTINS) / sizeof(BUILTINS[0]))
+
+// Perfect hash of the registered names: no two of them share a slot (checked below).
+// A new name that collides needs other multipliers.
+#define BUILTIN_SLOTS (64)
+constexpr unsigned int builtinHash(const char* name, size_t length) {
+    return (length + (unsigned char)name[0] + 11 * (length > 1 ? (unsigned char)name[1] : 0)
+            + (unsigned char)name[length - 1]) % BUILTIN_SLOTS;
+}
+
+// index of the entry whose name hashes to slot (starting from entry), -1 if none
+constexpr int builtinOfSlot(unsigned int slot, int entry = 0) {
+    return entry == BUILTINS_COUNT ? -1 :
+           builtinHash(BUILTINS[entry].name, BUILTINS[entry].length) == slot ? entry :
+           builtinOfSlot(slot, entry + 1);
+}
+
+constexpr bool builtinsCollide(int entry = 0) {
+    return entry < BUILTINS_COUNT &&
+           (builtinOfSlot(builtinHash(BUILTINS[entry].name, BUILTINS[entry].length)) != entry ||
+            builtinsCollide(entry + 1));
+}
+static_assert(!builtinsCollide(), "two built-in commands share a hash slot, change builtinHash");
+
+#define SLOT(i) builtinOfSlot(i)
+#define SLOTS_8(i) SLOT(i), SLOT(i + 1), SLOT(i + 2), SLOT(i + 3), SLOT(i + 4), SLOT(i + 5), SLOT(i + 6), SLOT(i + 7)
+static constexpr signed char BUILTIN_OF_SLOT[BUILTIN_SLOTS] = {
+    SLOTS_8(0), SLOTS_8(8), SLOTS_8(16), SLOTS_8(24), SLOTS_8(32), SLOTS_8(40), SLOTS_8(48), SLOTS_8(56)
+};
+
+const BuiltinEntry* findBuiltin(const char* cmd_part) {
+    cmd_part += strspn(cmd_part, WHITESPACE.c_str());
+    size_t end = strlen(cmd_part);
+    while (end > 0 && strchr(WHITESPACE.c_str(), cmd_part[end - 1]) != nullptr) end--;
+
+    // the name ends at the first space, or at an ampersand that ends the line ("jobs&")
+    size_t length = strcspn(cmd_part, " ");
+    if (length >= end) {
+        length = end;
+        if (length > 0 && cmd_part[length - 1] == '&') length--;
+    }
+    if (length == 0) return nullptr;
+
+    int entry = BUILTIN_OF_SLOT[builtinHash(cmd_part, length)];
+    if (entry < 0) return nullptr;
+    const BuiltinEntry& builtin = BUILTINS[entry];
+    if (builtin.length != length || memcmp(cmd_part, builtin.name, length) != 0) return nullptr;
+    return &builtin;
 }
 
 //---------------------------SMALL SHELL--------------------------------------
-SmallShell::SmallShell() : prompt("smash"), old_pwd("") {
+SmallShell::SmallShell() : prompt("smash"), old_pwd(""), executing(0) {
     jobs = new JobsList();
     CURR_FORK_CHILD_RUNNING = 0;
     GLOBAL_JOBS_POINTER = jobs;
@@ -1234,42 +2336,87 @@ SmallShell::~SmallShell() {
 * Creates and returns a pointer to Command class which matches the given command line (cmd_line)
 */
 Command* SmallShell::CreateCommand(const char* cmd_line) {
-    string cmd_s = _trim(string(cmd_line));
-    if (cmd_s.compare("timeout") == 0 || cmd_s.compare("timeout&") == 0 || cmd_s.find("timeout ") == 0) {
-        return new TimeoutCommand(cmd_line, this);
-    } else if (cmd_s.find("|") != string::npos) {
-        return new PipeCommand(cmd_line, this);
-    } else if (cmd_s.find(">") != string::npos) {
-        return new RedirectionCommand(cmd_line, this);
-    } else if (cmd_s.compare("chprompt") == 0 || cmd_s.compare("chprompt&") == 0|| cmd_s.find("chprompt ") == 0) {
-        return new ChangePromptCommand(cmd_line, this);
-    } else if (cmd_s.compare("showpid") == 0 || cmd_s.compare("showpid&") == 0  || cmd_s.find("showpid ") == 0) {
-        return new ShowPidCommand(cmd_line);
-    } else if (cmd_s.compare("pwd") == 0 || cmd_s.compare("pwd&") == 0 ||cmd_s.find("pwd ") == 0) {
-        return new GetCurrDirCommand(cmd_line);
-    } else if (cmd_s.compare("cd") == 0 || cmd_s.compare("cd&") == 0 || cmd_s.find("cd ") == 0) {
-        return new ChangeDirCommand(cmd_line, &this->old_pwd);
-    } else if (cmd_s.compare("jobs") == 0 || cmd_s.compare("jobs&") == 0 || cmd_s.find("jobs ") == 0) {
-        return new JobsCommand(cmd_line, this->jobs);
-    } else if (cmd_s.compare("kill") == 0 || cmd_s.compare("kill&") == 0 || cmd_s.find("kill ") == 0) {
-        return new KillCommand(cmd_line, this->jobs);
-    } else if (cmd_s.compare("fg") == 0 || cmd_s.compare("fg&") == 0 ||cmd_s.find("fg ") == 0) {
-        return new ForegroundCommand(cmd_line, this->jobs);
-    } else if (cmd_s.compare("bg") == 0 || cmd_s.compare("bg&") == 0 ||cmd_s.find("bg ") == 0) {
-        return new BackgroundCommand(cmd_line, this->jobs);
-    } else if (cmd_s.compare("quit") == 0 || cmd_s.compare("quit&") == 0 || cmd_s.find("quit ") == 0) {
-        return new QuitCommand(cmd_line, this->jobs);
-    } else if (cmd_s.compare("cp") == 0 || cmd_s.compare("cp&") == 0 || cmd_s.find("cp ") == 0) {
-        return new CopyCommand(cmd_line, this->jobs);
+    int64_t start = phaseStart();
+
+    // a line that was parsed before is only copied
+    Command* cached = LINE_CACHE.find(cmd_line);
+    if (cached != nullptr) {
+        phaseEnd(PHASE_CREATE, start);
+        return cached;
+    }
+
+    // find the class of the command
+    Command* (*create)(const char* cmd_line, SmallShell* shell);
+    const BuiltinEntry* builtin = findBuiltin(cmd_line);
+    if (builtin == nullptr && isCompoundLine(cmd_line)) {
+        create = createJobsBuiltin<ExternalCommand>;
+    } else if (findChainOperator(cmd_line) != nullptr) {
+        create = createBuiltin<ChainCommand>;
+    } else if (builtin != nullptr && (builtin->flags & BUILTIN_WRAPS)) {
+        create = builtin->create;
+    } else if (strchr(cmd_line, '|') != nullptr) {
+        create = createBuiltin<PipeCommand>;
+    } else if (strpbrk(cmd_line, "<>") != nullptr && !hasBashRedirection(cmd_line)) {
+        create = createBuiltin<RedirectionCommand>;
+    } else if (builtin != nullptr) {
+        create = builtin->create;
     } else {
-        return new ExternalCommand(cmd_line, this->jobs);
+        create = createJobsBuiltin<ExternalCommand>;
     }
+    start = phaseEnd(PHASE_CREATE, start);
+
+    // its constructor parses the arguments
+    Command* cmd = create(cmd_line, this);
+    LINE_CACHE.insert(cmd_line, cmd);
+    phaseEnd(PHASE_PARSE, start);
+    return cmd;
+}
+
+#ifdef SMASH_TRACE
+static TraceClass traceClassOf(Command* cmd) {
+    if (dynamic_cast<ExternalCommand*>(cmd) != nullptr) return TRACE_EXTERNAL;
+    if (dynamic_cast<PipeCommand*>(cmd) != nullptr) return TRACE_PIPE;
+    if (dynamic_cast<RedirectionCommand*>(cmd) != nullptr) return TRACE_REDIRECTION;
+    if (dynamic_cast<TimeoutCommand*>(cmd) != nullptr) return TRACE_TIMEOUT;
+    if (dynamic_cast<CopyCommand*>(cmd) != nullptr) return TRACE_COPY;
+    return TRACE_BUILTIN;
 }
+#endif
 
 void SmallShell::executeCommand(const char *cmd_line) {
+#ifdef SMASH_TRACE
+    // every command is measured (a nested one, like the command of timeout, is part of the outer one)
+    PhaseTimes phases;
+    PhaseTimes* outer_phases = MEASURED_PHASES;
+    MEASURED_PHASES = &phases;
+    int64_t start = phaseStart();
+#endif
+
+    // the command and its strings are allocated from the arena and freed together
+    // (this is nested for commands that run other commands, like timeout)
+    Arena::Mark line_start = LINE_ARENA.mark();
     Command *cmd = CreateCommand(cmd_line);
-    cmd->execute();
+
+    // a background job without a free slot waits in the queue
+    bool starts_job = cmd->inBackground() && isSmash();
+    if (starts_job && jobs->mustQueue()) {
+        jobs->queueJob(cmd_line);
+    } else {
+        executing++;
+        cmd->execute();
+        executing--;
+        if (starts_job) jobs->releasePendingToken();   // it didn't become a job
+    }
+#ifdef SMASH_TRACE
+    traceCommand(traceClassOf(cmd), phases, phaseStart() - start);
+    MEASURED_PHASES = outer_phases;
+    if (outer_phases != nullptr) outer_phases->merge(phases);
+#endif
     delete cmd;
+    LINE_ARENA.rewind(line_start);
+
+    // slots may have been freed while it was executed
+    startQueuedJobs();
 }
 
 void SmallShell::changePrompt(const string& str) {
@@ -1281,10 +2428,72 @@ const string& SmallShell::getPrompt() {
     return prompt;
 }
 
-JobEntry* SmallShell::addJob(pid_t pid, const string& str, bool is_stopped, bool is_timeout, unsigned int time_limit) {
-    return jobs->addJob(pid, str, is_stopped, is_timeout, time_limit);
+JobsList* SmallShell::getJobsList() {
+    return jobs;
+}
+
+string* SmallShell::getOldPwd() {
+    return &old_pwd;
+}
+
+JobEntry* SmallShell::addJob(pid_t pid, const string& str, bool is_stopped, bool is_timeout,
+                             TimerID timer, unsigned int processes) {
+    return jobs->addJob(pid, str, is_stopped, is_timeout, timer, processes);
+}
+
+void SmallShell::removeJob(pid_t pid) {
+    jobs->removeJobByPid(pid);
 }
 
 void SmallShell::updateJobs() {
     jobs->removeFinishedJobs();
 }
+
+bool SmallShell::setJobSlots(unsigned int slots) {
+    return jobs->jobserver.create(slots);
+}
+
+void SmallShell::joinJobServer() {
+    jobs->jobserver.join();
+}
+
+void SmallShell::startQueuedJobs() {
+    // not in the middle of a command, unless it's a foreground command that is waited for
+    if (executing > 0 && CURR_FORK_CHILD_RUNNING == 0) return;
+    while (jobs->slotAvailable()) startQueuedJob(jobs->queued_jobs.front(), false);
+
+    // the rest wait for a token (the implicit one comes back with SIGCHLD)
+    if (hasQueuedJobs() && jobs->jobserver.active()) watchReadableOnce(jobs->jobserver.readFd(), jobServerHandler);
+}
+
+void SmallShell::startQueuedJob(JobID job_id, bool foreground) {
+    string cmd_line = jobs->takeQueuedJob(job_id);
+    if (cmd_line.empty()) return;
+    if (foreground) checkAndRemoveAmpersand(cmd_line);
+
+    // it keeps its job id (if it doesn't start, for example when the spawn fails, it's just gone)
+    jobs->next_job_id = job_id;
+
+    // a background job may start while a foreground command is waited for, it's not a part
+    // of its status or its "time" (nor of the status of the last command, like bash's "&")
+    int status = LAST_STATUS;
+    JobUsage* timed_usage = TIMED_USAGE;
+    PhaseTimes* measured_phases = MEASURED_PHASES;
+    if (!foreground) {
+        TIMED_USAGE = nullptr;
+        MEASURED_PHASES = nullptr;
+    }
+    executing++;
+    executeCommand(cmd_line.c_str());
+    executing--;
+    if (!foreground) {
+        LAST_STATUS = status;
+        TIMED_USAGE = timed_usage;
+        MEASURED_PHASES = measured_phases;
+    }
+    jobs->next_job_id = 0;
+}
+
+bool SmallShell::hasQueuedJobs() {
+    return !jobs->queued_jobs.empty();
+}
@@ -3,6 +3,10 @@
 
 #include <vector>
 #include <map>
+#include <deque>
+#include <list>
+#include <algorithm>
+#include <unordered_map>
 #include <string>
 #include <cstring>
 #include <limits>
@@ -12,24 +16,45 @@
 #include <csignal>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
 #include <fcntl.h>
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <iomanip>
-
-#include "Commands.h"
+#include <thread>
+#include <atomic>
+
+#include "spawn.h"
+#include "reactor.h"
+#include "tokenizer.h"
+#include "arena.h"
+#include "jobserver.h"
+#include "latency.h"
+#include "pathcache.h"
+#include "linecache.h"
 
 using std::vector;
 using std::string;
 using std::map;
+using std::deque;
+using std::unordered_map;
 
 // macros
-#define COMMAND_MAX_ARGS (20)
 #define COMMAND_MAX_CHARS (80)
-#define COPY_DATA_BUFFER_SIZE (1024)
+#define COPY_DATA_BUFFER_SIZE (1 << 20)     // used only if the kernel can't copy by itself
+#define COPY_DATA_BUFFER_ALIGNMENT (4096)
+#define COPY_DATA_CHUNK_SIZE (1 << 30)      // max bytes per copy_file_range/sendfile call
+#define COPY_PARALLEL_RANGE_SIZE (64 << 20) // size of the ranges that "cp -j" threads take
+#define COPY_MAX_THREADS (64)
+#define PIPE_RELAY_CHUNK_SIZE (1 << 16)     // bytes per tee/splice of a "|+" relay (a full default pipe)
 
 #define STDIN 0
 #define STDOUT 1
@@ -43,25 +68,44 @@ extern pid_t CURR_FORK_CHILD_RUNNING;   // PID of the process currently in the f
 extern pid_t SMASH_PROCESS_PID;         // PID of the SMASH process
 extern JobsList* GLOBAL_JOBS_POINTER;   // pointer to the Jobs list in SmallSHell
 extern bool QUIT_SHELL;                 // While this is false the smash will keep running
+extern int LAST_STATUS;                 // exit status of the last command, like bash's $? (for "&&", "||")
 
-// global variables for managing multiple alarms:
-extern double TIME_UNTIL_NEXT_ALARM;    // leftover duration until next alarm signal is sent
-extern time_t TIME_AT_LAST_UPDATE;      // used for updating TIME_UNTIL_NEXT_ALARM
+// counters of the way external commands were launched
+extern unsigned long DIRECT_EXEC_COUNT;  // exec'd directly after a PATH lookup
+extern unsigned long BASH_EXEC_COUNT;    // handed to "/bin/bash -c"
 
 
 //---------------------------JOBS LISTS------------------------------
+// resources used by the reaped processes of a job (from wait4)
+struct JobUsage {
+    int64_t started;            // monotonicNow() when the job started, for its wall time
+    unsigned int exited;        // reaped processes
+    pid_t last_pid;             // the process whose status is the job's (the last stage of a pipeline), 0 if any
+    int status;                 // wait status of last_pid (or of the last reaped process), -1 if none
+    struct timeval user_time, system_time;
+    long max_rss;               // in KiB, of the biggest process
+    long voluntary_switches, involuntary_switches;
+
+    JobUsage();
+    void add(pid_t pid, int wait_status, const struct rusage& usage);
+    void merge(const JobUsage& other);
+};
+
 struct JobEntry {
     pid_t pid;
     string cmd_str;
     bool is_stopped;        //  is the job stopped
     bool is_timeout;        // is this a timeout command
-    unsigned int time_limit;  // relevant if this is a timeout command
+    bool is_queued;         // waiting for a job slot, not started yet (pid is 0)
+    int token;              // jobserver token of a job that was started in the background
+    TimerID timer;          // relevant if this is a timeout command
     time_t start_time;
-    time_t original_start_time; // relevant if this is a timeout command
+    unsigned int processes;     // unreaped processes in the job's group (more than 1 for pipelines)
+    JobUsage usage;
 
     explicit JobEntry(pid_t pid = 0, const string& cmd_str = "",
                       bool is_stopped = false, bool is_timeout = false,
-                      unsigned int time_limit = 0);
+                      TimerID timer = 0);
     void SetTime();
 };
 typedef int JobID;
@@ -69,31 +113,88 @@ typedef int JobID;
 class JobsList {
 public:
     map<JobID,JobEntry> jobs;
+    unordered_map<pid_t,JobID> job_of_group;            // pid of a job (its group id) -> job id
+    unordered_map<pid_t,JobUsage> unclaimed_exits;      // reaped processes of groups that aren't jobs
+    vector<JobID> finished_jobs;    // jobs whose processes were all reaped before they were added
+    JobServer jobserver;            // the job slots, unlimited unless it's active
+    int pending_token = JOBSERVER_NO_TOKEN;     // taken for the background job that is starting
+    deque<JobID> queued_jobs;       // background jobs waiting for a slot, first in first out
+    JobID next_job_id = 0;          // if not 0, the id addJob gives (a queued job keeps its id when it starts)
 
     JobsList() = default;
-    ~JobsList() = default;
+    ~JobsList();
     JobEntry* addJob(pid_t pid, const string& cmd_str, bool is_stopped = false,
-                     bool is_timeout = false, unsigned int time_limit = 0);
+                     bool is_timeout = false, TimerID timer = 0, unsigned int processes = 1);
 
-    void printJobsList();
+    /// \param long_format - Also print the resources each job used ("jobs -l")
+    void printJobsList(bool long_format = false);
     void killAllJobs();
+
+    /// Reaps the children that exited since the last call and removes the jobs they finished.
+    /// Does nothing unless SIGCHLD was received, and then costs O(1) per exited child.
     void removeFinishedJobs();
     JobEntry* getJobById(JobID jobId);
+    JobEntry* getJobByPid(pid_t pid);
     void removeJobById(JobID jobId);
+    void removeJobByPid(pid_t pid);
     JobEntry* getLastJob(JobID* lastJobId);
     JobEntry* getLastStoppedJob(JobID* jobId);
+
+    /// Takes a slot (a jobserver token) for a background job that is about to start.
+    /// The next job that is added holds it, until it's removed.
+    /// \return True if the job can't start now (no free slot, or others wait before it)
+    bool mustQueue();
+    /// Adds a background job that will start when a slot is free
+    void queueJob(const string& cmd_str);
+    /// Takes a slot for the first queued job, like mustQueue
+    /// \return True if it can start
+    bool slotAvailable();
+    /// Removes a queued job from the list, to start it
+    /// \return Its command line
+    string takeQueuedJob(JobID jobId);
+    /// Gives back the slot mustQueue/slotAvailable took, if no job was added with it
+    void releasePendingToken();
+
+    /// Takes the processes of a group that were reaped while it wasn't a job
+    /// (e.g. a foreground command reaped by the alarm handler)
+    /// \param pgid - The group
+    /// \param max - Max number of processes to take
+    /// \param usage - Adds the resources they used to it, if not nullptr
+    /// \return Number of processes taken
+    unsigned int claimExits(pid_t pgid, unsigned int max, JobUsage* usage = nullptr);
+    /// Takes the status of a group from one of its processes (the last stage of a pipeline),
+    /// also if it's reaped before the group is claimed
+    void setLastProcess(pid_t pgid, pid_t pid);
+
+private:
+    void processExited(pid_t pgid, pid_t pid, int status, const struct rusage& usage);
+
+    /// Gives back the slot of a job that is removed
+    void releaseToken(JobEntry& job);
 };
 
 //-------------------------ABSTRACT COMMAND------------------------
 
+// Commands and their strings (LineString) live in LINE_ARENA: they must not be kept after
+// SmallShell::executeCommand returns, anything that outlives the line is copied out.
 class Command {
 protected:
-    string original_cmd;
+    LineString original_cmd;
 
 public:
     explicit Command(const char* cmd_line) : original_cmd(cmd_line) {};
     virtual ~Command() = default;
     virtual void execute() = 0;
+
+    /// \return True if the command starts a background job (it may have to wait for a job slot)
+    virtual bool inBackground() const { return false; }
+
+    /// \return A copy (in LINE_ARENA) to execute the same line again without parsing it, for
+    ///         LINE_CACHE. nullptr if parsing it depends on more than the line (or printed an error).
+    virtual Command* clone() const { return nullptr; }
+
+    static void* operator new(size_t size) { return LINE_ARENA.allocate(size); }
+    static void operator delete(void* ptr) {}   // freed by rewinding the arena
 };
 
 
@@ -101,62 +202,147 @@ public:
 
 class PipeCommand : public Command {
     SmallShell* shell;
-    bool has_ampersand, background;
-    string command1, command2;
+    bool background;
+    bool invalid_args;
+    LineVector<LineString> stages;  // the commands of the pipeline, in order
+    LineVector<bool> to_stderr;     // to_stderr[i] is true if stage i is followed by "|&"
+    unsigned int producer;          // the stage "|+" copies to every stage after it, stages.size() if none
 
 public:
     PipeCommand(const char* cmd_line, SmallShell* shell);
     virtual ~PipeCommand() = default;
     void execute() override;
+    Command* clone() const override { return invalid_args ? nullptr : new PipeCommand(*this); }
+    bool inBackground() const override { return background; }
 
 private:
-    /// A function that forks two children and sets their write/read
-    /// to the ends of the given pipe accordingly.
-    /// \param my_pipe - The pipe that both children have to use to communicate
-    /// \param pid1 - Pointer to the first child's PID
-    /// \param pid2 - Pointer to the second child's PID
-    /// \return False if one of the fork()s failed, else True
-    bool Pipe(int my_pipe[], pid_t* pid1, pid_t* pid2);
+    /// Spawns a single stage of the pipeline as a direct child, with its
+    /// read/write set to the ends of the pipes around it.
+    /// \param index - Index of the stage
+    /// \param input - Read end of the pipe it reads, -1 for smash's input
+    /// \param output - Write end of the pipe it writes, -1 for smash's output
+    /// \param pipes - Every end of every pipe of the pipeline, closed in the stage
+    /// \param pgid - Process group of the stage (like SpawnAttributes::pgid)
+    /// \return PID of the stage, or -1 if the spawn failed
+    pid_t spawnStage(unsigned int index, int input, int output, const vector<int>& pipes, pid_t pgid);
+
+    /// Spawns a relay of "|+", a fork of smash in the group of the pipeline that copies
+    /// its input to two pipes inside the kernel (tee to one, then splice to the other)
+    /// \return PID of the relay, or -1 if the fork failed
+    pid_t spawnRelay(int input, int tee_output, int splice_output, const vector<int>& pipes, pid_t pgid);
+
+    /// \return True if the first stage is a built-in command that only prints, run in smash itself
+    bool headRunsInSmash() const;
+
+    /// Runs the first stage in smash, its output is written to the pipe without blocking
+    /// smash (what the pipe can't take yet is written whenever it becomes writable)
+    /// \param output - Write end of the pipe it writes, closed once everything was written
+    void runHead(int output);
+};
+
+#define REDIRECT_BOTH (-1)     // Redirection::fd of "&>", stdout and stderr
+
+// one redirection of a command: "N< file", "N> file", "N>> file", "&> file" or "N>&M"
+struct Redirection {
+    int fd;                 // the fd of the command it sets, or REDIRECT_BOTH
+    int source;             // the fd it copies, -1 if it opens a file
+    int flags;              // open flags of the file (relevant if source is -1)
+    LineString pathname;    // relevant if source is -1
 };
 
 class RedirectionCommand : public Command {
     SmallShell* shell;
-    bool to_append;     // true if ">>"
     bool to_background;
+    bool invalid_args;
     bool cmd_is_built_in;     // built-in commands should not fork
-    string cmd_part;
-    string pathname;
+    bool cmd_is_external;     // external commands get the redirections as fd setup of their exec
+    LineString cmd_part;
+    LineVector<Redirection> redirections;   // in order, each applies to the fds the ones before it set
 
 public:
     RedirectionCommand(const char* cmd_line, SmallShell* shell);
     virtual ~RedirectionCommand() = default;
     void execute() override;
+    Command* clone() const override { return invalid_args ? nullptr : new RedirectionCommand(*this); }
+    bool inBackground() const override { return to_background; }
+    bool isExternal() const { return cmd_is_external && !invalid_args; }
+
+    /// Launches the external command with the redirections, without waiting for it
+    /// \param attr - File actions, process group and signal handling of the child, the
+    ///                redirections are applied after its file actions
+    /// \return PID of the child, or -1 if a file couldn't be opened or the spawn failed
+    pid_t spawn(SpawnAttributes attr);
+
+private:
+    /// Opens the files of the redirections and adds them to attr as file actions
+    /// \param files - Gets the opened fds, to close once the child was launched
+    /// \return False if a file couldn't be opened (then nothing is left open)
+    bool openFiles(SpawnAttributes& attr, vector<int>& files);
 };
 
 class TimeoutCommand : public Command {
     SmallShell* shell;
     bool to_background;
-    unsigned int duration;
-    string cmd_part;
+    double duration;        // in seconds, with millisecond resolution
+    LineString cmd_part;
     bool cmd_is_built_in; // built in command should not fork
 
 public:
     TimeoutCommand(const char* cmd_line, SmallShell* shell);
     virtual ~TimeoutCommand() = default;
     void execute() override;
+    bool inBackground() const override { return to_background; }
+};
+
+// a list of commands separated by ";", "&&" and "||", parsed once and run in order
+class ChainCommand : public Command {
+    SmallShell* shell;
+    bool invalid_args;
+    LineVector<LineString> commands;
+    LineVector<char> operators;     // between command i and i+1: ';', '&' for "&&" or '|' for "||"
+
+public:
+    ChainCommand(const char* cmd_line, SmallShell* shell);
+    virtual ~ChainCommand() = default;
+    void execute() override;
+    Command* clone() const override { return invalid_args ? nullptr : new ChainCommand(*this); }
+};
+
+class TimeCommand : public Command {
+    SmallShell* shell;
+    LineString cmd_part;    // always run in the foreground
+
+public:
+    TimeCommand(const char* cmd_line, SmallShell* shell);
+    virtual ~TimeCommand() = default;
+    void execute() override;
 };
 
 //---------------------------EXTERNAL CLASS------------------------------
 
 class ExternalCommand : public Command {
-    string cmd_to_son;
+    LineString cmd_to_son;
     JobsList* jobs;
     bool to_background;
+    bool direct_exec;           // true if the command doesn't need bash
+    string exec_path;           // resolved path of the binary (relevant if direct_exec)
+    LineVector<LineString> exec_args;   // argv of the binary (relevant if direct_exec)
 
 public:
     ExternalCommand(const char* cmd_line, JobsList* jobs);
     virtual ~ExternalCommand() = default;
     void execute() override;
+    // a path relative to the current directory (like "./a.out", or found through a relative
+    // directory of PATH) may not be the same binary after a cd, so it isn't kept
+    Command* clone() const override {
+        return direct_exec && exec_path[0] != '/' ? nullptr : new ExternalCommand(*this);
+    }
+    bool inBackground() const override { return to_background; }
+
+    /// Launches the command without waiting for it
+    /// \param attr - File actions, process group and signal handling of the child
+    /// \return PID of the child, or -1 if the spawn failed
+    pid_t spawn(const SpawnAttributes& attr);
 };
 
 
@@ -170,7 +356,7 @@ public:
 
 class ChangePromptCommand : public BuiltInCommand {
     SmallShell* shell;
-    string prompt;
+    LineString prompt;
 
 public:
     ChangePromptCommand(const char* cmd_line, SmallShell* shell);
@@ -184,6 +370,7 @@ public:
     explicit ShowPidCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {};
     virtual ~ShowPidCommand() = default;
     void execute() override;
+    Command* clone() const override { return new ShowPidCommand(*this); }
 };
 
 class GetCurrDirCommand : public BuiltInCommand {
@@ -191,11 +378,12 @@ public:
     explicit GetCurrDirCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
     virtual ~GetCurrDirCommand() = default;
     void execute() override;
+    Command* clone() const override { return new GetCurrDirCommand(*this); }
 };
 
 class ChangeDirCommand : public BuiltInCommand {
     string* old_pwd;
-    string new_path;
+    LineString new_path;
 
 public:
     ChangeDirCommand(const char* cmd_line, string* last_dir);
@@ -203,13 +391,48 @@ public:
     void execute() override;
 };
 
+class ExecStatsCommand : public BuiltInCommand {
+public:
+    explicit ExecStatsCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+    virtual ~ExecStatsCommand() = default;
+    void execute() override;
+};
+
+class StatsCommand : public BuiltInCommand {
+public:
+    explicit StatsCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+    virtual ~StatsCommand() = default;
+    void execute() override;
+};
+
+class HashCommand : public BuiltInCommand {
+    bool reset;     // "-r" given
+    LineVector<LineString> names;   // commands to look up and keep
+
+public:
+    explicit HashCommand(const char* cmd_line);
+    virtual ~HashCommand() = default;
+    void execute() override;
+};
+
+class TypeCommand : public BuiltInCommand {
+    LineVector<LineString> names;
+
+public:
+    explicit TypeCommand(const char* cmd_line);
+    virtual ~TypeCommand() = default;
+    void execute() override;
+};
+
 class JobsCommand : public BuiltInCommand {
     JobsList* jobs;
+    bool long_format;   // "-l" given
 
 public:
     JobsCommand(const char* cmd_line, JobsList* jobs);
     virtual ~JobsCommand() = default;
     void execute() override;
+    Command* clone() const override { return new JobsCommand(*this); }
 };
 
 class KillCommand : public BuiltInCommand {
@@ -273,24 +496,72 @@ public:
     void execute() override;
 };
 
+// the ways cp can move the data, from the fastest
+enum CopyMethod {
+    COPY_REFLINK,       // FICLONE ioctl, shares the extents (btrfs, XFS)
+    COPY_FILE_RANGE,    // copy_file_range, copied inside the kernel (may be offloaded)
+    COPY_SENDFILE,      // sendfile, copied inside the kernel
+    COPY_BUFFER         // read/write through a buffer in user space
+};
+
 class CopyCommand : public BuiltInCommand {
-    string old_path, new_path;
+    LineString old_path, new_path;
     bool background;
+    bool verbose;       // "-v" given: report the copy method
+    bool invalid_args;
+    unsigned int threads;   // "-j N" given: copy with N threads in parallel
     JobsList* jobs;
 
 public:
     explicit CopyCommand(const char* cmd_line, JobsList* jobs);
     virtual ~CopyCommand() = default;
     void execute() override;
+    bool inBackground() const override { return background; }
 
     /// Checks if old_path and new_path reference the same file
     /// \return True if it's the same file, otherwise False
     bool comparePaths();
 
     bool openFiles(int* fd_read, int* fd_write);
-    bool copyData(int fd_read, int fd_write, int SIZE);
+
+    /// Copies all the data, trying the kernel copy methods before falling back to a buffer
+    /// \param method - Pointer to the method that was used
+    /// \return True on success, otherwise False
+    bool copyData(int fd_read, int fd_write, CopyMethod* method);
+
+    /// Copies the file in ranges using a pool of threads, each copying with copy_file_range
+    /// (or pread/pwrite if it isn't supported). The destination is preallocated.
+    /// \param method - Pointer to the method that was used
+    /// \return 1 on success, 0 if the source can't be copied in parallel, -1 on error
+    int copyDataParallel(int fd_read, int fd_write, CopyMethod* method);
+
+private:
+    /// Each returns 1 on success, 0 if the method isn't supported for these files
+    /// (nothing was copied, the next method can be tried), or -1 on error
+    int copyReflink(int fd_read, int fd_write);
+    int copyKernel(int fd_read, int fd_write, bool use_sendfile);
+    int copyBuffer(int fd_read, int fd_write);
+    static int copyRange(int fd_read, int fd_write, off_t offset, off_t length, CopyMethod* method);
 };
 
+//---------------------------BUILT IN REGISTRY------------------------------
+// flags of a built-in command
+#define BUILTIN_FORKS (1 << 0)  // runs in a child of its own, so it isn't run inside smash when timed out
+#define BUILTIN_WRAPS (1 << 1)  // takes a whole command line, matched before the pipe/redirection operators
+#define BUILTIN_PRINTS (1 << 2) // only prints, so at the head of a pipeline it runs inside smash
+
+struct BuiltinEntry {
+    const char* name;
+    size_t length;      // of name
+    int flags;
+    Command* (*create)(const char* cmd_line, SmallShell* shell);
+};
+
+/// Finds the built-in command a command line starts with, in O(1)
+/// \param cmd_part - A command line
+/// \return The registry entry, nullptr if it isn't a built-in command
+const BuiltinEntry* findBuiltin(const char* cmd_part);
+
 //---------------------------SMALL SHELL--------------------------------
 
 class SmallShell {
@@ -298,6 +569,7 @@ private:
     string prompt;
     string old_pwd;
     JobsList *jobs;
+    unsigned int executing;     // depth of executeCommand calls, queued jobs start only between commands
 
 public:
     SmallShell();
@@ -315,8 +587,26 @@ public:
     void executeCommand(const char *cmd_line);
     void changePrompt(const string &prompt);
     const string &getPrompt();
-    JobEntry* addJob(pid_t pid, const string &str, bool is_stopped = false, bool is_timeout = false, unsigned int time_limit = 0);
+    JobsList* getJobsList();
+    string* getOldPwd();
+    JobEntry* addJob(pid_t pid, const string &str, bool is_stopped = false, bool is_timeout = false,
+                     TimerID timer = 0, unsigned int processes = 1);
+    void removeJob(pid_t pid);
     void updateJobs();
+
+    /// Limits the number of background jobs running at once, the others wait in a queue.
+    /// smash becomes the jobserver of its children, with slots tokens.
+    /// \return False if the jobserver couldn't be created
+    bool setJobSlots(unsigned int slots);
+    /// Takes the slots of background jobs from the jobserver of MAKEFLAGS, if there is one
+    void joinJobServer();
+    /// Starts the queued jobs that have a free slot, does nothing while a command is executed
+    void startQueuedJobs();
+    /// Starts a queued job now, even without a free slot
+    /// \param foreground - Run it in the foreground (for fg)
+    void startQueuedJob(JobID job_id, bool foreground);
+    /// \return True if jobs are waiting for slots
+    bool hasQueuedJobs();
 };
 
 #endif //SMASH_COMMAND_H_
\ No newline at end of file
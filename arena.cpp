@@ -0,0 +1,63 @@
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#include "arena.h"
+
+Arena LINE_ARENA;
+
+Arena::~Arena() {
+    for (auto& block : blocks) free(block.data);
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    while (true) {
+        if (current.block < blocks.size()) {
+            Block& block = blocks[current.block];
+            size_t offset = (current.offset + alignment - 1) & ~(alignment - 1);
+            if (offset + size <= block.size) {
+                current.offset = offset + size;
+                return block.data + offset;
+            }
+
+            // doesn't fit, move to the next block
+            current.block++;
+            current.offset = 0;
+            if (current.block < blocks.size() && blocks[current.block].size >= size + alignment) continue;
+
+            // the next block is too small for it, replace it
+            if (current.block < blocks.size()) {
+                free(blocks[current.block].data);
+                blocks.erase(blocks.begin() + current.block);
+            }
+        }
+
+        // add a block, big enough for this allocation
+        size_t new_size = block_size;
+        while (new_size < size + alignment) new_size *= 2;
+        char* data = static_cast<char*>(malloc(new_size));
+        if (data == nullptr) throw std::bad_alloc();
+        blocks.insert(blocks.begin() + current.block, Block{data, new_size});
+        current.offset = 0;
+    }
+}
+
+void Arena::swap(Arena& other) {
+    std::swap(blocks, other.blocks);
+    std::swap(current, other.current);
+    std::swap(block_size, other.block_size);
+}
+
+#ifdef SMASH_ALLOC_STATS
+std::atomic<unsigned long> HEAP_ALLOCATIONS(0);  // atomic, cp -j allocates from its threads
+
+void* operator new(size_t size) {
+    HEAP_ALLOCATIONS++;
+    void* ptr = malloc(size ? size : 1);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+#endif
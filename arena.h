@@ -0,0 +1,76 @@
+#ifndef SMASH_ARENA_H_
+#define SMASH_ARENA_H_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <atomic>
+
+#define ARENA_BLOCK_SIZE (64 << 10)     // a typical line uses a small part of the first block
+
+// A bump allocator. Allocating moves a pointer forward, and everything allocated
+// after a mark is freed at once by rewinding to it. The blocks are kept for reuse,
+// so once it grew to the size of the largest line it doesn't touch the heap anymore.
+class Arena {
+public:
+    struct Mark {
+        size_t block;
+        size_t offset;
+    };
+
+    explicit Arena(size_t block_size = ARENA_BLOCK_SIZE) : current({0, 0}), block_size(block_size) {}
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    /// \return The position that rewind() returns to
+    Mark mark() const { return current; }
+
+    /// Frees everything that was allocated after the mark (without destructing it)
+    void rewind(Mark mark) { current = mark; }
+
+    /// Exchanges the memory of two arenas, so what is allocated from one goes to the other's
+    void swap(Arena& other);
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    Mark current;
+    size_t block_size;      // of a new block, unless an allocation needs more
+};
+
+// holds the Command of the line being executed and its strings,
+// rewound by SmallShell::executeCommand after the command ran
+extern Arena LINE_ARENA;
+
+// STL allocator on LINE_ARENA, deallocation does nothing (the rewind frees)
+template <class T>
+struct LineAllocator {
+    typedef T value_type;
+
+    LineAllocator() = default;
+    template <class U> LineAllocator(const LineAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(LINE_ARENA.allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+};
+template <class T, class U>
+bool operator==(const LineAllocator<T>&, const LineAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const LineAllocator<T>&, const LineAllocator<U>&) { return false; }
+
+// strings and vectors that live as long as the line
+typedef std::basic_string<char, std::char_traits<char>, LineAllocator<char>> LineString;
+template <class T> using LineVector = std::vector<T, LineAllocator<T>>;
+
+#ifdef SMASH_ALLOC_STATS
+// counted by the global operator new (built with "make ALLOC_STATS=1")
+extern std::atomic<unsigned long> HEAP_ALLOCATIONS;
+#endif
+
+#endif //SMASH_ARENA_H_
@@ -0,0 +1,87 @@
+#ifndef SMASH_BENCH_H_
+#define SMASH_BENCH_H_
+
+// What the benchmarks share: timing, the JSON line each result is printed as,
+// and running the smash binary.
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <initializer_list>
+#include <vector>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef BENCH_LINKS_LIB_OBJS
+// defined in smash.cpp, which isn't linked
+pid_t SMASH_PROCESS_PID = 0;
+bool QUIT_SHELL = false;
+#endif
+
+/// \return Seconds of the monotonic clock
+inline double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One result: {"bench":"name","key":value,...} on its own line, printed by print().
+// Strings are quoted, numbers aren't. Nothing is escaped, the values are ours.
+class JsonLine {
+public:
+    explicit JsonLine(const char* bench) {
+        out << "{\"bench\":\"" << bench << "\"";
+    }
+    JsonLine& add(const char* key, const char* value) {
+        out << ",\"" << key << "\":\"" << value << "\"";
+        return *this;
+    }
+    JsonLine& add(const char* key, const std::string& value) {
+        return add(key, value.c_str());
+    }
+    template <typename Number>
+    JsonLine& add(const char* key, Number value) {
+        out << ",\"" << key << "\":" << value;
+        return *this;
+    }
+    void print() {
+        std::cout << out.str() << "}" << std::endl;
+    }
+
+private:
+    std::ostringstream out;
+};
+
+/// Runs smash with args, its stdout thrown away
+/// \param input File for its stdin, or nullptr to keep ours
+/// \param quiet Throws its stderr away too
+/// \return Seconds it took, negative on failure
+inline double runSmash(const char* smash, std::initializer_list<const char*> args,
+                       const char* input = nullptr, bool quiet = false) {
+    std::vector<char*> argv;
+    argv.push_back(const_cast<char*>(smash));
+    for (const char* arg : args) argv.push_back(const_cast<char*>(arg));
+    argv.push_back(nullptr);
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        if (quiet) dup2(null_fd, STDERR_FILENO);
+        if (input != nullptr) {
+            int input_fd = open(input, O_RDONLY);
+            dup2(input_fd, STDIN_FILENO);
+        }
+        execv(smash, argv.data());
+        _exit(127);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    return now() - start;
+}
+
+#endif //SMASH_BENCH_H_
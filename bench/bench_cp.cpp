@@ -0,0 +1,78 @@
+// cp throughput benchmark: MB/s of smash's cp from 4 KiB to 256 MiB files, with one
+// thread and (for the big files) with "cp -j 4". Each size runs as one script, so
+// starting smash is paid once for many copies.
+//
+// usage: bench_cp [smash binary] [directory for the files]
+// output: one JSON object per line
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "bench.h"
+
+using namespace std;
+
+#define TOTAL_BYTES_PER_RUN (512L << 20)    // copies of each size add up to about this
+#define MAX_COPIES_PER_RUN (200)
+#define MIN_COPIES_PER_RUN (3)
+
+/// Creates a file of size bytes with data that isn't all zeros
+static bool createFile(const string& path, long size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    vector<char> chunk(1 << 20);
+    for (size_t i = 0; i < chunk.size(); i++) chunk[i] = (char)(i * 31 + 7);
+    for (long written = 0; written < size;) {
+        long length = min<long>(chunk.size(), size - written);
+        if (write(fd, chunk.data(), length) != length) {
+            close(fd);
+            return false;
+        }
+        written += length;
+    }
+    return close(fd) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    const char* smash = argc > 1 ? argv[1] : "./smash";
+    string dir = argc > 2 ? argv[2] : "/tmp";
+    string source = dir + "/bench_cp_source." + to_string(getpid());
+    string destination = dir + "/bench_cp_destination." + to_string(getpid());
+    string script = dir + "/bench_cp_script." + to_string(getpid());
+
+    int result = 0;
+    for (long size : {4L << 10, 1L << 20, 64L << 20, 256L << 20}) {
+        if (!createFile(source, size)) {
+            perror("bench_cp: creating the source failed");
+            result = 1;
+            break;
+        }
+        long copies = max<long>(MIN_COPIES_PER_RUN, min<long>(MAX_COPIES_PER_RUN, TOTAL_BYTES_PER_RUN / size));
+
+        for (int threads : {1, 4}) {
+            if (threads > 1 && size < (64L << 20)) continue;   // too small to split
+
+            ofstream out(script);
+            for (long i = 0; i < copies; i++) {
+                out << "cp " << (threads > 1 ? "-j " + to_string(threads) + " " : "") << source << " " << destination << '\n';
+            }
+            out.close();
+
+            double elapsed = runSmash(smash, {"-s", script.c_str()});
+            if (elapsed < 0) {
+                cerr << "bench_cp: " << smash << " failed" << endl;
+                result = 1;
+                break;
+            }
+            JsonLine("cp").add("bytes", size).add("threads", threads).add("copies", copies)
+                .add("mb_per_sec", (double)size * copies / (1 << 20) / elapsed).print();
+        }
+    }
+
+    unlink(source.c_str());
+    unlink(destination.c_str());
+    unlink(script.c_str());
+    return result;
+}
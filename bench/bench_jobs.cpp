@@ -0,0 +1,73 @@
+// JobsList benchmark: the cost of each jobs operation with 10, 1k and 100k jobs.
+// The jobs have fake pids, nothing is spawned, so only the table is measured.
+//
+// usage: bench_jobs
+// output: one JSON object per line
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+#include "Commands.h"
+#include "bench.h"
+
+using namespace std;
+
+#define FIRST_FAKE_PID (1 << 22)    // above pid_max, no real process has these
+
+static void report(const char* op, int jobs, int ops, double elapsed) {
+    JsonLine("jobs").add("jobs", jobs).add("op", op).add("ops", ops).add("ops_per_sec", ops / elapsed).print();
+}
+
+int main() {
+    SMASH_PROCESS_PID = getpid();
+    if (!reactorInit(-1)) return 1;
+
+    // printJobsList writes here, so only the formatting is measured
+    ofstream null_out("/dev/null");
+    mt19937 random(1);
+
+    for (int count : {10, 1000, 100000}) {
+        JobsList jobs;
+        vector<JobID> ids(count);
+
+        double start = now();
+        for (int i = 0; i < count; i++) {
+            jobs.addJob(FIRST_FAKE_PID + i, "sleep 100&");
+            ids[i] = i + 1;     // the ids are given in order
+        }
+        report("add", count, count, now() - start);
+
+        // lookups, in a random order so the map isn't walked in order
+        shuffle(ids.begin(), ids.end(), random);
+        int lookups = max(count, 100000);
+        start = now();
+        for (int i = 0; i < lookups; i++) jobs.getJobById(ids[i % count]);
+        report("get_by_id", count, lookups, now() - start);
+
+        start = now();
+        for (int i = 0; i < lookups; i++) jobs.getJobByPid(FIRST_FAKE_PID + ids[i % count] - 1);
+        report("get_by_pid", count, lookups, now() - start);
+
+        // no job is stopped, so it's the worst case (every job is checked)
+        int searches = max(10, 1000000 / count);
+        JobID stopped_id;
+        start = now();
+        for (int i = 0; i < searches; i++) jobs.getLastStoppedJob(&stopped_id);
+        report("last_stopped", count, searches, now() - start);
+
+        streambuf* cout_buffer = cout.rdbuf(null_out.rdbuf());
+        start = now();
+        jobs.printJobsList();
+        double elapsed = now() - start;
+        cout.rdbuf(cout_buffer);
+        report("print_per_job", count, count, elapsed);
+
+        start = now();
+        for (int i = 0; i < count; i++) jobs.removeJobById(ids[i]);
+        report("remove", count, count, now() - start);
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+// Parser benchmark: command lines/sec through SmallShell::CreateCommand (finding the
+// class and running its constructor), for each kind of line. Nothing is executed.
+// Every line is measured as a miss of LINE_CACHE (parsed, and kept if it can be) and
+// as a hit (copied from the cache, the same as parsing for lines that aren't kept).
+//
+// usage: bench_parse [iterations per line]
+// output: one JSON object per line
+
+#include <cstdlib>
+
+#include "Commands.h"
+#include "bench.h"
+
+using namespace std;
+
+static const char* LINES[] = {
+    "jobs",
+    "chprompt bench",
+    "ls -la /tmp",
+    "grep -r --include=*.cpp pattern src include &",
+    "cat /etc/passwd | grep root | wc -l",
+    "echo hello world >> /tmp/bench_parse_output",
+    "timeout 0.25 sleep 10&",
+    "cp -j 4 /tmp/some/source/file.bin /tmp/some/destination/file.bin",
+};
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    SMASH_PROCESS_PID = getpid();
+    SmallShell& shell = SmallShell::getInstance();
+
+    for (const char* line : LINES) {
+        for (bool hit : {false, true}) {
+            double start = now();
+            for (int i = 0; i < iterations; i++) {
+                if (!hit) LINE_CACHE.clear();
+                Arena::Mark line_start = LINE_ARENA.mark();
+                delete shell.CreateCommand(line);
+                LINE_ARENA.rewind(line_start);
+            }
+            double elapsed = now() - start;
+            JsonLine("parse").add("line", line).add("cache", hit ? "hit" : "miss").add("iterations", iterations)
+                .add("lines_per_sec", iterations / elapsed).print();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+// Pipe throughput benchmark: MB/s through pipelines of 2 to 8 stages run by smash,
+// "head -c SIZE /dev/zero | cat | ... | wc -c" (the cats move the data between the pipes).
+//
+// usage: bench_pipe [megabytes per run] [smash binary]
+// output: one JSON object per line
+
+#include <string>
+#include <cstdlib>
+
+#include "bench.h"
+
+using namespace std;
+
+int main(int argc, char* argv[]) {
+    int megabytes = argc > 1 ? atoi(argv[1]) : 512;
+    const char* smash = argc > 2 ? argv[2] : "./smash";
+
+    for (int stages : {2, 4, 8}) {
+        string pipeline = "head -c " + to_string(megabytes) + "M /dev/zero";
+        for (int i = 2; i < stages; i++) pipeline += " | cat";
+        pipeline += " | wc -c";
+
+        double elapsed = runSmash(smash, {"-c", pipeline.c_str()});
+        if (elapsed < 0) {
+            cerr << "bench_pipe: " << smash << " failed" << endl;
+            return 1;
+        }
+        JsonLine("pipe").add("stages", stages).add("mb", megabytes).add("mb_per_sec", megabytes / elapsed).print();
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Script throughput benchmark: lines/sec of smash running a generated script of
+// built-in commands, through -s and through a redirected stdin (with prompts).
+//
+// usage: bench_script [lines] [smash binary]
+// output: one JSON object per line
+
+#include <fstream>
+#include <string>
+#include <cstdlib>
+
+#include "bench.h"
+
+using namespace std;
+
+// commands that run inside smash, so the shell itself is measured (and not fork/exec)
+static const char* SCRIPT_LINES[] = {
+    "chprompt bench",
+    "cd .",
+    "jobs",
+    "pwd",
+    "showpid",
+    "",
+    "# comment",
+    "kill -9 1",
+};
+
+int main(int argc, char* argv[]) {
+    int lines = argc > 1 ? atoi(argv[1]) : 200000;
+    const char* smash = argc > 2 ? argv[2] : "./smash";
+
+    char script[] = "/tmp/bench_script_XXXXXX";
+    int script_fd = mkstemp(script);
+    if (script_fd < 0) {
+        perror("bench_script: mkstemp failed");
+        return 1;
+    }
+    close(script_fd);
+
+    ofstream out(script);
+    const int kinds = sizeof(SCRIPT_LINES) / sizeof(SCRIPT_LINES[0]);
+    for (int i = 0; i < lines; i++) out << SCRIPT_LINES[i % kinds] << '\n';
+    out.close();
+
+    for (bool use_stdin : {false, true}) {
+        double elapsed = use_stdin ? runSmash(smash, {}, script, true) : runSmash(smash, {"-s", script}, nullptr, true);
+        if (elapsed < 0) {
+            cerr << "bench_script: " << smash << " failed" << endl;
+            unlink(script);
+            return 1;
+        }
+        JsonLine("script").add("mode", use_stdin ? "stdin" : "script").add("lines", lines)
+            .add("lines_per_sec", lines / elapsed).print();
+    }
+
+    unlink(script);
+    return 0;
+}
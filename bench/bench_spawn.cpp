@@ -0,0 +1,82 @@
+// Spawn rate benchmark: fork()+execv() against spawnExec(), with posix_spawn and with the
+// spawn server (started before the ballast, the way smash starts it before it grows).
+// The cost of fork() grows with the RSS of the parent, so every mode is measured
+// again after the process grows by a ballast, the way smash grows with its job table.
+//
+// usage: bench_spawn [spawns per run]
+// output: one JSON object per line
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "spawn.h"
+#include "bench.h"
+
+using namespace std;
+
+static char* const TRUE_ARGV[] = {const_cast<char*>("/bin/true"), nullptr};
+
+static pid_t forkExec() {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        execv(TRUE_ARGV[0], TRUE_ARGV);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t posixSpawn() {
+    SpawnAttributes attr;
+    attr.pgid = 0;
+    return spawnExec(TRUE_ARGV[0], TRUE_ARGV, attr);
+}
+
+static pid_t serverSpawn() {
+    useSpawnServer(true);
+    pid_t pid = posixSpawn();
+    useSpawnServer(false);
+    return pid;
+}
+
+static void run(const char* mode, pid_t (*spawn)(), int spawns, size_t rss_mb) {
+    double start = now();
+    for (int i = 0; i < spawns; i++) {
+        pid_t pid = spawn();
+        if (pid < 0) {
+            perror("bench_spawn: spawn failed");
+            exit(1);
+        }
+        waitpid(pid, nullptr, 0);
+    }
+    double elapsed = now() - start;
+
+    JsonLine("spawn").add("mode", mode).add("rss_mb", rss_mb).add("spawns", spawns)
+        .add("spawns_per_sec", spawns / elapsed).print();
+}
+
+int main(int argc, char* argv[]) {
+    int spawns = argc > 1 ? atoi(argv[1]) : 1000;
+
+    if (!startSpawnServer()) return 1;
+    useSpawnServer(false);
+
+    vector<char*> ballast;
+    for (size_t rss_mb : {0, 256, 1024}) {
+        // grow to rss_mb, touching every page so it's really mapped
+        while (ballast.size() < rss_mb) {
+            char* chunk = new char[1 << 20];
+            memset(chunk, 1, 1 << 20);
+            ballast.push_back(chunk);
+        }
+
+        run("fork_exec", forkExec, spawns, rss_mb);
+        run("posix_spawn", posixSpawn, spawns, rss_mb);
+        run("spawn_server", serverSpawn, spawns, rss_mb);
+    }
+
+    for (char* chunk : ballast) delete[] chunk;
+    return 0;
+}
@@ -0,0 +1,61 @@
+// Timeout benchmark: arming and canceling timers with 10, 1k and 100k pending
+// (the heap of the reactor), and the latency from a deadline until its alarm was handled.
+//
+// usage: bench_timeout [fires]
+// output: one JSON object per line
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cstdlib>
+
+#include "Commands.h"
+#include "bench.h"
+
+using namespace std;
+
+#define FIRE_AFTER (0.002)      // seconds from arming a timer until it expires
+#define PENDING_DURATION (1e6)  // seconds, the pending timers never expire during the benchmark
+
+int main(int argc, char* argv[]) {
+    int fires = argc > 1 ? atoi(argv[1]) : 500;
+    SMASH_PROCESS_PID = getpid();
+    SmallShell::getInstance();  // alarmHandler checks its jobs
+    if (!reactorInit(-1)) return 1;
+    mt19937 random(1);
+
+    for (int count : {10, 1000, 100000}) {
+        vector<TimerID> timers(count);
+        double start = now();
+        for (int i = 0; i < count; i++) timers[i] = addTimer(PENDING_DURATION, 0);
+        double elapsed = now() - start;
+        JsonLine("timeout").add("op", "arm").add("pending", count).add("ops_per_sec", count / elapsed).print();
+
+        shuffle(timers.begin(), timers.end(), random);
+        start = now();
+        for (TimerID timer : timers) cancelTimer(timer);
+        elapsed = now() - start;
+        JsonLine("timeout").add("op", "cancel").add("pending", count).add("ops_per_sec", count / elapsed).print();
+    }
+
+    // alarmHandler prints "got an alarm" for each of them
+    ofstream null_out("/dev/null");
+    streambuf* cout_buffer = cout.rdbuf(null_out.rdbuf());
+    vector<double> latencies;
+    for (int i = 0; i < fires; i++) {
+        double deadline = now() + FIRE_AFTER;
+        addTimer(FIRE_AFTER, 0);
+        waitForEvent();
+        latencies.push_back(now() - deadline);
+    }
+    cout.rdbuf(cout_buffer);
+
+    sort(latencies.begin(), latencies.end());
+    JsonLine("timeout").add("op", "fire").add("fires", fires)
+        .add("p50_us", latencies[fires / 2] * 1e6)
+        .add("p99_us", latencies[fires * 99 / 100] * 1e6)
+        .add("max_us", latencies.back() * 1e6).print();
+    return 0;
+}
@@ -0,0 +1,89 @@
+// Tokenizer benchmark: the given _parseCommandLine (istringstream + malloc per token)
+// against CommandTokens (views into one buffer), on a few typical command lines.
+//
+// usage: bench_tokenizer [iterations per line]
+// output: one JSON object per line
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+
+#include "tokenizer.h"
+#include "bench.h"
+
+using namespace std;
+
+#define LEGACY_MAX_ARGS (20)
+
+static const char* LINES[] = {
+    "ls",
+    "kill -9 3",
+    "cp -v -j 4 /tmp/some/source/file.bin /tmp/some/destination/file.bin &",
+    "timeout 0.25 grep -r --include=*.cpp pattern src include tests docs",
+};
+
+static const string WHITESPACE = " \n\r\t\f\v";
+
+// the given implementation, as it was in Commands.cpp
+static string _ltrim(const string& s) {
+    size_t start = s.find_first_not_of(WHITESPACE);
+    return (start == string::npos) ? "" : s.substr(start);
+}
+static string _rtrim(const string& s) {
+    size_t end = s.find_last_not_of(WHITESPACE);
+    return (end == string::npos) ? "" : s.substr(0, end + 1);
+}
+static string _trim(const string& s) {
+    return _rtrim(_ltrim(s));
+}
+static int _parseCommandLine(const char* cmd_line, char** args) {
+    int i = 0;
+    istringstream iss(_trim(string(cmd_line)).c_str());
+    for (string s; iss >> s;) {
+        args[i] = (char *) malloc(s.length() + 1);
+        memset(args[i], 0, s.length() + 1);
+        strcpy(args[i], s.c_str());
+        args[++i] = nullptr;
+    }
+    return i;
+}
+
+// keeps the compiler from dropping the work
+static volatile size_t SINK = 0;
+
+static int legacy(const char* line) {
+    char* args[LEGACY_MAX_ARGS + 1];
+    int num_of_args = _parseCommandLine(line, args);
+    SINK += args[num_of_args - 1][0];
+    for (int i = 0; i < num_of_args; i++) free(args[i]);
+    return num_of_args;
+}
+
+static int tokens(const char* line) {
+    CommandTokens args(line);
+    SINK += args[args.size() - 1][0];
+    return args.size();
+}
+
+static void run(const char* mode, int (*tokenize)(const char*), const char* line, int iterations) {
+    long total_tokens = 0;
+    double start = now();
+    for (int i = 0; i < iterations; i++) total_tokens += tokenize(line);
+    double elapsed = now() - start;
+
+    JsonLine("tokenizer").add("mode", mode).add("line_chars", strlen(line))
+        .add("tokens", total_tokens / iterations).add("iterations", iterations)
+        .add("tokens_per_sec", total_tokens / elapsed).print();
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    for (const char* line : LINES) {
+        run("parse_command_line", legacy, line, iterations);
+        run("command_tokens", tokens, line, iterations);
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "jobserver.h"
+
+#define JOBSERVER_TOKEN ('+')   // what make writes
+
+bool JobServer::open(const char* read_path, const char* write_path) {
+    read_fd = ::open(read_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    write_fd = ::open(write_path, O_WRONLY | O_CLOEXEC);
+    if (read_fd < 0 || write_fd < 0) {
+        if (read_fd >= 0) close(read_fd);
+        if (write_fd >= 0) close(write_fd);
+        read_fd = write_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool JobServer::create(unsigned int slots) {
+    // the children inherit the pipe, so it isn't close-on-exec
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("smash error: pipe failed");
+        return false;
+    }
+
+    // the implicit token is the first slot
+    for (unsigned int i = 1; i < slots; i++) {
+        char token = JOBSERVER_TOKEN;
+        if (write(fds[1], &token, 1) != 1) {
+            perror("smash error: write failed");
+            return false;
+        }
+    }
+
+    // reopened through /proc: O_NONBLOCK on the inherited description would reach make too
+    std::string read_path = "/proc/self/fd/" + std::to_string(fds[0]);
+    std::string write_path = "/proc/self/fd/" + std::to_string(fds[1]);
+    if (!open(read_path.c_str(), write_path.c_str())) {
+        perror("smash error: open failed");
+        return false;
+    }
+
+    // export it, instead of any jobserver or -j that was given from above
+    std::string makeflags;
+    const char* old_flags = getenv("MAKEFLAGS");
+    std::istringstream words(old_flags ? old_flags : "");
+    for (std::string word; words >> word;) {
+        if (word.compare(0, 2, "-j") == 0 || word.compare(0, 12, "--jobserver-") == 0) continue;
+        makeflags += word + " ";
+    }
+    makeflags += "-j" + std::to_string(slots) + " --jobserver-auth=" +
+                 std::to_string(fds[0]) + "," + std::to_string(fds[1]);
+    if (setenv("MAKEFLAGS", makeflags.c_str(), 1) < 0) perror("smash error: setenv failed");
+    return true;
+}
+
+bool JobServer::join() {
+    const char* makeflags = getenv("MAKEFLAGS");
+    if (makeflags == nullptr) return false;
+
+    // the last one wins, like in make ("--jobserver-fds" is the name before make 4.2)
+    std::string auth;
+    std::istringstream words(makeflags);
+    for (std::string word; words >> word;) {
+        size_t value = word.find('=');
+        if (value == std::string::npos) continue;
+        std::string option = word.substr(0, value);
+        if (option == "--jobserver-auth" || option == "--jobserver-fds") auth = word.substr(value + 1);
+    }
+    if (auth.empty()) return false;
+
+    // "fifo:PATH" (make 4.4) or "R,W"
+    if (auth.compare(0, 5, "fifo:") == 0) {
+        std::string path = auth.substr(5);
+        return open(path.c_str(), path.c_str());
+    }
+
+    int fd_read, fd_write;
+    if (sscanf(auth.c_str(), "%d,%d", &fd_read, &fd_write) != 2) return false;
+
+    // make closes them for commands it doesn't consider recursive (no '+' or $(MAKE))
+    if (fcntl(fd_read, F_GETFD) < 0 || fcntl(fd_write, F_GETFD) < 0) return false;
+
+    std::string read_path = "/proc/self/fd/" + std::to_string(fd_read);
+    std::string write_path = "/proc/self/fd/" + std::to_string(fd_write);
+    return open(read_path.c_str(), write_path.c_str());
+}
+
+int JobServer::acquire() {
+    if (implicit_free) {
+        implicit_free = false;
+        return JOBSERVER_IMPLICIT_TOKEN;
+    }
+
+    while (true) {
+        char token;
+        ssize_t read_retVal = read(read_fd, &token, 1);
+        if (read_retVal == 1) return (unsigned char)token;
+        if (read_retVal < 0 && errno == EINTR) continue;
+        if (read_retVal < 0 && errno != EAGAIN) perror("smash error: read failed");
+        return JOBSERVER_NO_TOKEN;
+    }
+}
+
+void JobServer::release(int token) {
+    if (token == JOBSERVER_NO_TOKEN) return;
+    if (token == JOBSERVER_IMPLICIT_TOKEN) {
+        implicit_free = true;
+        return;
+    }
+
+    char byte = (char)token;
+    while (write(write_fd, &byte, 1) < 0) {
+        if (errno == EINTR) continue;
+        perror("smash error: write failed");
+        return;
+    }
+}
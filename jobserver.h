@@ -0,0 +1,51 @@
+#ifndef SMASH_JOBSERVER_H_
+#define SMASH_JOBSERVER_H_
+
+// A GNU make jobserver: a pipe (or a named fifo) holding one byte per job that
+// may run, besides the one every process gets for free (the implicit token).
+// A job takes a byte before it starts and writes it back when it finished, so
+// every process that shares the pipe shares one concurrency budget.
+//
+// smash joins the jobserver of a make that runs it (MAKEFLAGS=--jobserver-auth=),
+// or creates one for "smash -j N" and exports it to its children the same way,
+// so a make started from smash takes its tokens from the same pipe.
+
+#define JOBSERVER_NO_TOKEN (-1)
+#define JOBSERVER_IMPLICIT_TOKEN (256)  // held without reading the pipe (not a byte)
+
+class JobServer {
+public:
+    JobServer() : read_fd(-1), write_fd(-1), implicit_free(true) {}
+    JobServer(const JobServer&) = delete;
+    JobServer& operator=(const JobServer&) = delete;
+
+    /// Creates a jobserver with slots tokens (one of them implicit) and exports it in MAKEFLAGS
+    /// \return False on failure (the error was printed)
+    bool create(unsigned int slots);
+
+    /// Joins the jobserver given in MAKEFLAGS, if there is one
+    /// \return False if there is none or it can't be used
+    bool join();
+
+    bool active() const { return read_fd >= 0; }
+
+    /// Takes a token without blocking
+    /// \return The token (JOBSERVER_IMPLICIT_TOKEN or the byte read), JOBSERVER_NO_TOKEN if none is free
+    int acquire();
+
+    /// Gives back a token taken by acquire()
+    void release(int token);
+
+    /// \return A file descriptor that is readable when the pipe may have a token
+    int readFd() const { return read_fd; }
+
+private:
+    int read_fd;        // a non-blocking description of our own, so the others' reads stay blocking
+    int write_fd;
+    bool implicit_free;
+
+    /// Opens the non-blocking read side and the write side of the jobserver
+    bool open(const char* read_path, const char* write_path);
+};
+
+#endif //SMASH_JOBSERVER_H_
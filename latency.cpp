@@ -0,0 +1,107 @@
+#include <iomanip>
+
+#include "latency.h"
+
+PhaseTimes* MEASURED_PHASES = nullptr;
+
+const char* const PHASE_NAMES[PHASE_COUNT] = {"create", "parse", "spawn", "wait", "reap"};
+
+static const char* const TRACE_CLASS_NAMES[TRACE_CLASS_COUNT] = {
+    "external", "pipe", "redirection", "timeout", "cp", "builtin"
+};
+
+void PhaseTimes::merge(const PhaseTimes& other) {
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        total[phase] += other.total[phase];
+        count[phase] += other.count[phase];
+    }
+}
+
+// bucket of a value: values under 4 have their own, above that each power of two
+// is split by the 2 bits that follow its highest bit
+static int bucketOf(int64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BUCKET_BITS)) return value < 0 ? 0 : (int)value;
+    int high_bit = 63 - __builtin_clzll((unsigned long long)value);
+    int shift = high_bit - HISTOGRAM_SUB_BUCKET_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BUCKET_BITS) + (int)((value >> shift) & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1));
+}
+
+// the largest value in a bucket
+static int64_t bucketEnd(int bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BUCKET_BITS)) return bucket;
+    int shift = (bucket >> HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    int64_t sub_bucket = (1 << HISTOGRAM_SUB_BUCKET_BITS) + (bucket & ((1 << HISTOGRAM_SUB_BUCKET_BITS) - 1));
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t nanoseconds) {
+    buckets[bucketOf(nanoseconds)]++;
+    samples++;
+    if (nanoseconds > max_value) max_value = nanoseconds;
+}
+
+int64_t LatencyHistogram::percentile(double fraction) const {
+    if (samples == 0) return 0;
+    unsigned long rank = (unsigned long)(fraction * samples + 0.5);
+    if (rank < 1) rank = 1;
+
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen >= rank) return bucketEnd(bucket) < max_value ? bucketEnd(bucket) : max_value;
+    }
+    return max_value;
+}
+
+// the histograms "stats" prints: each phase and the total, per command class
+static LatencyHistogram INPUT_HISTOGRAM;
+static LatencyHistogram PHASE_HISTOGRAMS[TRACE_CLASS_COUNT][PHASE_COUNT];
+static LatencyHistogram TOTAL_HISTOGRAMS[TRACE_CLASS_COUNT];
+
+void traceInput(int64_t nanoseconds) {
+    INPUT_HISTOGRAM.record(nanoseconds);
+}
+
+void traceCommand(TraceClass command_class, const PhaseTimes& phases, int64_t total) {
+    TOTAL_HISTOGRAMS[command_class].record(total);
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        // a phase the command didn't go through isn't a sample
+        if (phases.count[phase] > 0) PHASE_HISTOGRAMS[command_class][phase].record(phases.total[phase]);
+    }
+}
+
+// a latency with a unit that keeps it short (like 12.3us)
+static void printLatency(std::ostream& out, int64_t nanoseconds) {
+    static const char* const UNITS[] = {"ns", "us", "ms", "s"};
+    double value = nanoseconds;
+    int unit = 0;
+    for (; unit < 3 && value >= 1000; unit++) value /= 1000;
+    out << std::fixed << std::setprecision(unit == 0 ? 0 : 1) << value << UNITS[unit] << std::defaultfloat;
+}
+
+static void printHistogram(std::ostream& out, const char* name, const LatencyHistogram& histogram) {
+    out << "  " << std::left << std::setw(8) << name << std::right << " count=" << histogram.count();
+    out << " p50=";
+    printLatency(out, histogram.percentile(0.5));
+    out << " p99=";
+    printLatency(out, histogram.percentile(0.99));
+    out << " max=";
+    printLatency(out, histogram.max());
+    out << std::endl;
+}
+
+void printTraceStats(std::ostream& out) {
+    if (INPUT_HISTOGRAM.count() > 0) {
+        out << "input:" << std::endl;
+        printHistogram(out, "read", INPUT_HISTOGRAM);
+    }
+    for (int command_class = 0; command_class < TRACE_CLASS_COUNT; command_class++) {
+        if (TOTAL_HISTOGRAMS[command_class].count() == 0) continue;
+        out << TRACE_CLASS_NAMES[command_class] << ":" << std::endl;
+        printHistogram(out, "total", TOTAL_HISTOGRAMS[command_class]);
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            const LatencyHistogram& histogram = PHASE_HISTOGRAMS[command_class][phase];
+            if (histogram.count() > 0) printHistogram(out, PHASE_NAMES[phase], histogram);
+        }
+    }
+}
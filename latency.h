@@ -0,0 +1,105 @@
+#ifndef SMASH_LATENCY_H_
+#define SMASH_LATENCY_H_
+
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+
+// The time smash itself spends on a command, split into phases, so "time" can tell
+// whether a command is slow because of smash or because of the program.
+// Nothing is measured (not even the clock is read) unless MEASURED_PHASES is set.
+//
+// smash built with tracing (make TRACE=1, which defines SMASH_TRACE) measures every
+// command this way, and keeps a histogram of each phase per command class for "stats".
+// Without it, the tracing code isn't compiled at all.
+
+enum LatencyPhase {
+    PHASE_CREATE,   // CreateCommand finding the class of the command
+    PHASE_PARSE,    // the command's constructor parsing its arguments
+    PHASE_SPAWN,    // fork/posix_spawn, until it returns in smash (the child was exec'd)
+    PHASE_WAIT,     // waiting for a foreground group, until the last wake-up (not smash's time)
+    PHASE_REAP,     // from waking up for the last exit of a foreground group until its wait returns
+    PHASE_COUNT
+};
+
+struct PhaseTimes {
+    int64_t total[PHASE_COUNT];     // nanoseconds in each phase
+    unsigned int count[PHASE_COUNT];
+
+    PhaseTimes() : total(), count() {}
+    void merge(const PhaseTimes& other);
+};
+
+extern PhaseTimes* MEASURED_PHASES;     // set while "time" runs a command, nullptr otherwise
+
+extern const char* const PHASE_NAMES[PHASE_COUNT];
+
+/// \return The start of a phase (CLOCK_MONOTONIC in nanoseconds), 0 if nothing is measured
+inline int64_t phaseStart() {
+    if (MEASURED_PHASES == nullptr) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// Adds time to a phase, if it's measured
+inline void phaseAdd(LatencyPhase phase, int64_t nanoseconds) {
+    if (MEASURED_PHASES == nullptr) return;
+    MEASURED_PHASES->total[phase] += nanoseconds;
+    MEASURED_PHASES->count[phase]++;
+}
+
+/// Adds the time since start to a phase
+/// \return The end of the phase, the start of the next one
+inline int64_t phaseEnd(LatencyPhase phase, int64_t start) {
+    int64_t end = phaseStart();
+    if (start != 0 && end != 0) {
+        MEASURED_PHASES->total[phase] += end - start;
+        MEASURED_PHASES->count[phase]++;
+    }
+    return end;
+}
+
+// Latencies in log-scale buckets: 4 per power of two, so a percentile is at most 25% above
+// the real value, for any range of values in constant memory and O(1) per record
+#define HISTOGRAM_SUB_BUCKET_BITS (2)
+#define HISTOGRAM_BUCKETS (64 << HISTOGRAM_SUB_BUCKET_BITS)
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() : buckets(), samples(0), max_value(0) {}
+    void record(int64_t nanoseconds);
+
+    /// \param fraction - Of the samples, between 0 and 1 (0.99 for p99)
+    /// \return The upper bound of the bucket the percentile is in
+    int64_t percentile(double fraction) const;
+    int64_t max() const { return max_value; }
+    unsigned long count() const { return samples; }
+
+private:
+    unsigned long buckets[HISTOGRAM_BUCKETS];
+    unsigned long samples;
+    int64_t max_value;
+};
+
+// the command classes that are traced apart
+enum TraceClass {
+    TRACE_EXTERNAL,
+    TRACE_PIPE,
+    TRACE_REDIRECTION,
+    TRACE_TIMEOUT,
+    TRACE_COPY,
+    TRACE_BUILTIN,      // every other built-in command
+    TRACE_CLASS_COUNT
+};
+
+/// Records a line that was read: the time from showing the prompt until it was read
+void traceInput(int64_t nanoseconds);
+
+/// Records an executed command: its phases, and its total time (from CreateCommand until it's done)
+void traceCommand(TraceClass command_class, const PhaseTimes& phases, int64_t total);
+
+/// Prints count, p50, p99 and max of every histogram that has samples
+void printTraceStats(std::ostream& out);
+
+#endif //SMASH_LATENCY_H_
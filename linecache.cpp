@@ -0,0 +1,76 @@
+#include <cstdint>
+
+#include "linecache.h"
+#include "pathcache.h"
+#include "Commands.h"
+
+LineCache LINE_CACHE;
+
+/// FNV-1a, the line isn't copied into a string to be looked up
+static size_t hashLine(const char* cmd_line) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = cmd_line; *c != '\0'; c++) {
+        hash ^= static_cast<unsigned char>(*c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+LineCache::Entry::~Entry() {
+    delete cmd;     // its heap members, the arena frees the rest
+}
+
+Command* LineCache::find(const char* cmd_line) {
+    checkPaths();
+    auto position = index.find(hashLine(cmd_line));
+    if (position == index.end() || position->second->line != cmd_line) {
+        misses++;
+        return nullptr;
+    }
+
+    hits++;
+    entries.splice(entries.begin(), entries, position->second);    // the iterator stays valid
+    return position->second->cmd->clone();
+}
+
+void LineCache::insert(const char* cmd_line, const Command* cmd) {
+    // copy it into an arena of its own (nothing is allocated if it can't be copied)
+    Arena arena(LINE_CACHE_BLOCK_SIZE);
+    LINE_ARENA.swap(arena);
+    Command* kept = cmd->clone();
+    LINE_ARENA.swap(arena);
+    if (kept == nullptr) return;
+    Arena* entry_arena = new Arena();
+    entry_arena->swap(arena);
+
+    // replace the line with the same hash, or drop the least recently used one
+    size_t hash = hashLine(cmd_line);
+    auto old = index.find(hash);
+    if (old != index.end()) {
+        entries.erase(old->second);
+        index.erase(old);
+    } else if (entries.size() >= LINE_CACHE_SIZE) {
+        index.erase(hashLine(entries.back().line.c_str()));
+        entries.pop_back();
+    }
+    entries.emplace_front(cmd_line, entry_arena, kept);
+    index[hash] = entries.begin();
+}
+
+void LineCache::clear() {
+    index.clear();
+    entries.clear();
+}
+
+void LineCache::printStats(std::ostream& out) const {
+    out << "smash: line cache: " << hits << " hits, " << misses << " misses, "
+        << entries.size() << " lines" << std::endl;
+}
+
+void LineCache::checkPaths() {
+    unsigned long generation = PATH_CACHE.generation();
+    if (generation == path_generation) return;
+
+    path_generation = generation;
+    clear();
+}
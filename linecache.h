@@ -0,0 +1,67 @@
+#ifndef SMASH_LINECACHE_H_
+#define SMASH_LINECACHE_H_
+
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <ostream>
+
+#include "arena.h"
+
+#define LINE_CACHE_SIZE (256)               // lines kept, the least recently used one is dropped
+#define LINE_CACHE_BLOCK_SIZE (1 << 10)     // arena block of a kept command, enough for a typical line
+
+class Command;
+
+// The commands parsed from recent lines, so a line that comes again (a health check,
+// "jobs", a fixed pipeline) isn't classified and parsed again: the kept command is
+// copied into LINE_ARENA, ready to execute.
+//
+// A command is kept only if it can be copied (Command::clone), and what it depends on
+// forgets it: everything is forgotten when a path of PATH_CACHE is forgotten (PATH
+// changed, a directory of PATH changed, "hash -r"). A command that runs a path relative
+// to the current directory can't be copied, so a cd doesn't forget anything.
+
+class LineCache {
+public:
+    LineCache() : path_generation(0), hits(0), misses(0) {}
+    LineCache(const LineCache&) = delete;
+    LineCache& operator=(const LineCache&) = delete;
+
+    /// Copies the command kept for a line into LINE_ARENA, O(1)
+    /// \return The copy, nullptr if the line isn't kept
+    Command* find(const char* cmd_line);
+
+    /// Keeps a copy of the command parsed from a line, if it can be copied
+    void insert(const char* cmd_line, const Command* cmd);
+
+    /// Forgets every line
+    void clear();
+
+    /// Prints the number of hits and misses (for "execstats")
+    void printStats(std::ostream& out) const;
+
+private:
+    struct Entry {
+        std::string line;
+        std::unique_ptr<Arena> arena;   // the command and its strings
+        Command* cmd;
+
+        Entry(const char* line, Arena* arena, Command* cmd) : line(line), arena(arena), cmd(cmd) {}
+        ~Entry();
+    };
+
+    /// Forgets everything if the paths of PATH_CACHE changed
+    void checkPaths();
+
+    std::list<Entry> entries;   // most recently used first
+    std::unordered_map<size_t, std::list<Entry>::iterator> index;  // by the hash of the line
+    unsigned long path_generation;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+extern LineCache LINE_CACHE;
+
+#endif //SMASH_LINECACHE_H_
@@ -0,0 +1,151 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <iomanip>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "pathcache.h"
+#include "reactor.h"
+
+using std::string;
+
+#define DEFAULT_PATH "/bin:/usr/bin"    // if PATH isn't set
+
+// a binary appeared, disappeared or changed its mode in a watched directory
+#define PATH_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                           IN_DELETE_SELF | IN_MOVE_SELF)
+
+PathCache PATH_CACHE;
+
+static const char* currentPath() {
+    const char* path_env = getenv("PATH");
+    return path_env ? path_env : DEFAULT_PATH;
+}
+
+/// Looks for an executable file named name in every directory of PATH, in order
+static bool searchPath(const char* name, const char* path_list, string& full_path) {
+    const char* start = path_list;
+    while (true) {
+        const char* end = strchrnul(start, ':');
+
+        string candidate(start, end - start);
+        if (candidate.empty()) candidate = ".";     // empty entry means current directory
+        candidate += '/';
+        candidate += name;
+
+        struct stat st;
+        if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            full_path = candidate;
+            return true;
+        }
+        if (*end == '\0') return false;
+        start = end + 1;
+    }
+}
+
+PathCache::~PathCache() {
+    if (inotify_fd >= 0) close(inotify_fd);
+}
+
+bool PathCache::find(const char* name, string& full_path) {
+    // a name with a slash is never looked up in PATH
+    if (strchr(name, '/') != nullptr) {
+        full_path = name;
+        return access(name, X_OK) == 0;
+    }
+
+    checkPath();
+    auto entry = entries.find(name);
+    if (entry != entries.end()) {
+        entry->second.hits++;
+        full_path = entry->second.path;
+        return true;
+    }
+
+    if (!searchPath(name, path.c_str(), full_path)) return false;
+    if (full_path[0] == '/') entries[name] = Entry{full_path, 1};
+    return true;
+}
+
+const string* PathCache::cached(const char* name) {
+    checkPath();
+    auto entry = entries.find(name);
+    return entry == entries.end() ? nullptr : &entry->second.path;
+}
+
+void PathCache::forget(const char* name) {
+    entries.erase(name);
+    changes++;
+}
+
+void PathCache::clear() {
+    entries.clear();
+    changes++;
+}
+
+unsigned long PathCache::generation() {
+    checkPath();
+    return changes;
+}
+
+bool PathCache::print(std::ostream& out) {
+    checkPath();
+    if (entries.empty()) return false;
+
+    out << "hits\tcommand" << std::endl;
+    for (const auto& entry : entries) {
+        out << std::setw(4) << entry.second.hits << "\t" << entry.second.path << std::endl;
+    }
+    return true;
+}
+
+void PathCache::checkPath() {
+    const char* current = currentPath();
+    if (path == current) return;
+
+    path = current;
+    clear();
+    if (inotify_fd >= 0) rewatch();
+}
+
+bool PathCache::watchDirectories() {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) return false;
+
+    path = currentPath();
+    clear();
+    rewatch();
+    watchReadableOnce(inotify_fd, directoryChanged);
+    return true;
+}
+
+void PathCache::rewatch() {
+    for (int watch : watches) inotify_rm_watch(inotify_fd, watch);
+    watches.clear();
+
+    // relative directories aren't kept, so they aren't watched either
+    const char* start = path.c_str();
+    while (true) {
+        const char* end = strchrnul(start, ':');
+        if (*start == '/') {
+            // a directory that doesn't exist (yet) can't be watched, its binaries are found again anyway
+            int watch = inotify_add_watch(inotify_fd, string(start, end - start).c_str(),
+                                          PATH_WATCH_EVENTS | IN_ONLYDIR);
+            if (watch >= 0) watches.push_back(watch);
+        }
+        if (*end == '\0') break;
+        start = end + 1;
+    }
+}
+
+void PathCache::directoryChanged() {
+    // the events themselves don't matter, any of them may hide or reveal a binary
+    char events[4096];
+    while (read(PATH_CACHE.inotify_fd, events, sizeof(events)) > 0) {}
+
+    PATH_CACHE.clear();
+    watchReadableOnce(PATH_CACHE.inotify_fd, directoryChanged);
+}
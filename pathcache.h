@@ -0,0 +1,73 @@
+#ifndef SMASH_PATHCACHE_H_
+#define SMASH_PATHCACHE_H_
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <ostream>
+
+// The paths external commands were found at in PATH (like the hash table of bash),
+// so launching the same binary again doesn't stat every directory of PATH before it.
+//
+// Everything is forgotten when PATH changes (checked on every lookup). With
+// watchDirectories, an inotify watch on the directories of PATH also forgets it
+// when a binary is added, removed or renamed in one of them. Without it, a binary
+// that was removed is forgotten when launching it fails (see forget).
+// A binary found through a relative directory (like ".") depends on the current
+// directory, so it isn't kept.
+
+class PathCache {
+public:
+    PathCache() : inotify_fd(-1), changes(0) {}
+    ~PathCache();
+    PathCache(const PathCache&) = delete;
+    PathCache& operator=(const PathCache&) = delete;
+
+    /// Finds a binary in PATH, O(1) if it was found before
+    /// \param name - The command, a name with a slash is only checked (never kept)
+    /// \param full_path - Set to the binary's path
+    /// \return False if it isn't an executable in PATH
+    bool find(const char* name, std::string& full_path);
+
+    /// \return The kept path of name, nullptr if there is none (for "type")
+    const std::string* cached(const char* name);
+
+    /// Forgets the path of one command (its binary couldn't be launched)
+    void forget(const char* name);
+    /// Forgets every path ("hash -r")
+    void clear();
+
+    /// \return A number that changes whenever paths are forgotten, for what depends on them
+    ///         (it checks PATH first, like a lookup)
+    unsigned long generation();
+
+    /// Prints the kept paths with their number of hits, like "hash" of bash
+    /// \return False if there are none
+    bool print(std::ostream& out);
+
+    /// Forgets the paths when a directory of PATH changes, through inotify and the reactor
+    /// \return False if inotify isn't available (PATH changes are still noticed)
+    bool watchDirectories();
+
+private:
+    struct Entry {
+        std::string path;
+        unsigned long hits;
+    };
+
+    /// Forgets everything if PATH isn't the PATH the entries were found with
+    void checkPath();
+    /// Watches the directories of the current PATH instead of the old ones
+    void rewatch();
+    static void directoryChanged();
+
+    std::unordered_map<std::string, Entry> entries;
+    std::string path;       // the PATH the entries were found with
+    int inotify_fd;         // -1 unless the directories are watched
+    std::vector<int> watches;
+    unsigned long changes;  // times paths were forgotten
+};
+
+extern PathCache PATH_CACHE;
+
+#endif //SMASH_PATHCACHE_H_
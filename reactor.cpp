@@ -0,0 +1,382 @@
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <ctime>
+#include <vector>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "reactor.h"
+#include "signals.h"
+
+#define INPUT_READ_SIZE (1 << 16)   // a pipe's whole buffer, and many lines of a script per read
+#define MAX_EVENTS (8)
+
+static int INPUT_FD = 0;
+static bool INPUT_POLLABLE = true;  // false for regular files, which epoll can't watch (always readable)
+static int SIGNAL_FD = -1;          // SIGINT and SIGTSTP
+static int CHILD_FD = -1;           // SIGCHLD
+static int TIMER_FD = -1;           // timeouts
+static int EVENTS_EPOLL_FD = -1;    // every source except the input
+static int INPUT_EPOLL_FD = -1;     // the input and EVENTS_EPOLL_FD
+static bool CHILD_SIGNAL_RECEIVED = false;  // SIGCHLD was read, but nobody reaped yet
+static std::string INPUT_BUFFER;    // read input, the part from INPUT_START wasn't returned yet
+static size_t INPUT_START = 0;
+
+struct Timer {
+    int64_t deadline;   // CLOCK_MONOTONIC, in nanoseconds
+    TimerID id;
+    pid_t pid;
+};
+static std::vector<Timer> TIMERS;                          // min-heap by deadline
+static std::unordered_map<TimerID,size_t> TIMER_INDEX;     // timer id -> position in TIMERS
+static TimerID NEXT_TIMER_ID = 1;
+
+struct Watch {
+    int fd;
+    void (*handler)();
+    bool armed;
+};
+static std::vector<Watch> WATCHES;  // watchReadableOnce/watchWritableOnce, few (the jobserver, pipe writers)
+
+static bool addToEpoll(int epoll_fd, int fd) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+bool reactorInit(int input_fd) {
+    INPUT_FD = input_fd;
+
+    // the signals are only read through the signalfds (children get them unblocked)
+    sigset_t signals, child_signal;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTSTP);
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+
+    sigset_t blocked = signals;
+    sigaddset(&blocked, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &blocked, nullptr) < 0) {
+        perror("smash error: sigprocmask failed");
+        return false;
+    }
+
+    SIGNAL_FD = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    CHILD_FD = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (SIGNAL_FD < 0 || CHILD_FD < 0) {
+        perror("smash error: signalfd failed");
+        return false;
+    }
+
+    TIMER_FD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (TIMER_FD < 0) {
+        perror("smash error: timerfd_create failed");
+        return false;
+    }
+
+    EVENTS_EPOLL_FD = epoll_create1(EPOLL_CLOEXEC);
+    INPUT_EPOLL_FD = epoll_create1(EPOLL_CLOEXEC);
+    if (EVENTS_EPOLL_FD < 0 || INPUT_EPOLL_FD < 0) {
+        perror("smash error: epoll_create1 failed");
+        return false;
+    }
+
+    if (!addToEpoll(EVENTS_EPOLL_FD, SIGNAL_FD) || !addToEpoll(EVENTS_EPOLL_FD, CHILD_FD) ||
+        !addToEpoll(EVENTS_EPOLL_FD, TIMER_FD) || !addToEpoll(INPUT_EPOLL_FD, EVENTS_EPOLL_FD)) {
+        perror("smash error: epoll_ctl failed");
+        return false;
+    }
+
+    if (INPUT_FD < 0) {     // the input is only what appendInput gives
+        INPUT_POLLABLE = false;
+    } else if (!addToEpoll(INPUT_EPOLL_FD, INPUT_FD)) {
+        if (errno != EPERM) {
+            perror("smash error: epoll_ctl failed");
+            return false;
+        }
+        INPUT_POLLABLE = false;
+    }
+
+    return true;
+}
+
+static void handleSignals() {
+    struct signalfd_siginfo info;
+    while (read(SIGNAL_FD, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT) ctrlCHandler(SIGINT);
+        if (info.ssi_signo == SIGTSTP) ctrlZHandler(SIGTSTP);
+    }
+}
+
+static void handleChildSignal() {
+    // drain it, many exits can be merged into one signal anyway
+    struct signalfd_siginfo info;
+    while (read(CHILD_FD, &info, sizeof(info)) == sizeof(info)) CHILD_SIGNAL_RECEIVED = true;
+
+    if (CHILD_SIGNAL_RECEIVED) childHandler(SIGCHLD);
+}
+
+int64_t monotonicNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// Arms the timerfd for the earliest deadline, or disarms it if there are no timers
+static void armTimerFd() {
+    if (TIMER_FD < 0) return;
+    struct itimerspec timer = {};
+    if (!TIMERS.empty()) {
+        timer.it_value.tv_sec = TIMERS[0].deadline / 1000000000;
+        timer.it_value.tv_nsec = TIMERS[0].deadline % 1000000000;
+        // all zero would disarm it
+        if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0) timer.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(TIMER_FD, TFD_TIMER_ABSTIME, &timer, nullptr) < 0) {
+        perror("smash error: timerfd_settime failed");
+    }
+}
+
+static void placeTimer(size_t position, const Timer& timer) {
+    TIMERS[position] = timer;
+    TIMER_INDEX[timer.id] = position;
+}
+
+static void siftUp(size_t position) {
+    Timer timer = TIMERS[position];
+    while (position > 0) {
+        size_t parent = (position - 1) / 2;
+        if (TIMERS[parent].deadline <= timer.deadline) break;
+        placeTimer(position, TIMERS[parent]);
+        position = parent;
+    }
+    placeTimer(position, timer);
+}
+
+static void siftDown(size_t position) {
+    Timer timer = TIMERS[position];
+    while (true) {
+        size_t child = 2 * position + 1;
+        if (child >= TIMERS.size()) break;
+        if (child + 1 < TIMERS.size() && TIMERS[child + 1].deadline < TIMERS[child].deadline) child++;
+        if (timer.deadline <= TIMERS[child].deadline) break;
+        placeTimer(position, TIMERS[child]);
+        position = child;
+    }
+    placeTimer(position, timer);
+}
+
+/// Removes the timer at the given position of the heap
+static void removeTimerAt(size_t position) {
+    TIMER_INDEX.erase(TIMERS[position].id);
+    Timer last = TIMERS.back();
+    TIMERS.pop_back();
+    if (position == TIMERS.size()) return;  // it was the last one
+
+    placeTimer(position, last);
+    siftUp(position);
+    siftDown(TIMER_INDEX[last.id]);
+}
+
+static void handleTimer() {
+    uint64_t expirations;
+    if (read(TIMER_FD, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    alarmHandler(SIGALRM);
+    armTimerFd();   // for the next deadline
+}
+
+static void handleWatch(int fd) {
+    for (auto& watch : WATCHES) {
+        if (watch.fd != fd || !watch.armed) continue;
+        watch.armed = false;    // EPOLLONESHOT disabled it
+        watch.handler();
+        return;
+    }
+}
+
+/// Waits for events other than input and handles them
+/// \param timeout - Like epoll_wait: -1 blocks, 0 only handles the ready events
+static void handleEvents(int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(EVENTS_EPOLL_FD, events, MAX_EVENTS, timeout);
+    if (ready < 0) {
+        if (errno != EINTR) perror("smash error: epoll_wait failed");
+        return;
+    }
+
+    for (int i = 0; i < ready; i++) {
+        if (events[i].data.fd == SIGNAL_FD) handleSignals();
+        else if (events[i].data.fd == CHILD_FD) handleChildSignal();
+        else if (events[i].data.fd == TIMER_FD) handleTimer();
+        else handleWatch(events[i].data.fd);
+    }
+}
+
+void waitForInput() {
+    if (!INPUT_POLLABLE) {   // always readable, just handle what's ready
+        handleEvents(0);
+        return;
+    }
+
+    while (true) {
+        struct epoll_event events[2];
+        int ready = epoll_wait(INPUT_EPOLL_FD, events, 2, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("smash error: epoll_wait failed");
+            return;
+        }
+
+        // handle the events before reading the next command
+        bool input_ready = false;
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.fd == EVENTS_EPOLL_FD) handleEvents(0);
+            else input_ready = true;
+        }
+        if (input_ready) return;
+    }
+}
+
+void waitForEvent() {
+    handleEvents(-1);
+}
+
+TimerID addTimer(double seconds, pid_t pid) {
+    int64_t milliseconds = (int64_t)(seconds * 1000 + 0.5);
+    Timer timer = {monotonicNow() + milliseconds * 1000000, NEXT_TIMER_ID++, pid};
+
+    TIMERS.push_back(timer);
+    siftUp(TIMERS.size() - 1);
+
+    // only a new earliest deadline moves the timerfd
+    if (TIMERS[0].id == timer.id) armTimerFd();
+    return timer.id;
+}
+
+void cancelTimer(TimerID timer) {
+    auto found = TIMER_INDEX.find(timer);
+    if (found == TIMER_INDEX.end()) return;  // expired or cancelled already
+
+    bool was_earliest = found->second == 0;
+    removeTimerAt(found->second);
+    if (was_earliest) armTimerFd();
+}
+
+bool popExpiredTimer(TimerID* timer, pid_t* pid) {
+    if (TIMERS.empty() || TIMERS[0].deadline > monotonicNow()) return false;
+
+    *timer = TIMERS[0].id;
+    *pid = TIMERS[0].pid;
+    removeTimerAt(0);
+    return true;
+}
+
+/// Calls handler once, the next time fd has one of the events
+static void watchOnce(int fd, uint32_t events, void (*handler)()) {
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = fd;
+
+    for (auto& watch : WATCHES) {
+        if (watch.fd != fd) continue;
+        watch.handler = handler;
+        if (watch.armed) return;
+
+        // it's still in the epoll after it fired, only disabled
+        if (epoll_ctl(EVENTS_EPOLL_FD, EPOLL_CTL_MOD, fd, &event) < 0) {
+            perror("smash error: epoll_ctl failed");
+            return;
+        }
+        watch.armed = true;
+        return;
+    }
+
+    if (epoll_ctl(EVENTS_EPOLL_FD, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("smash error: epoll_ctl failed");
+        return;
+    }
+    WATCHES.push_back(Watch{fd, handler, true});
+}
+
+void watchReadableOnce(int fd, void (*handler)()) {
+    watchOnce(fd, EPOLLIN, handler);
+}
+
+void watchWritableOnce(int fd, void (*handler)()) {
+    watchOnce(fd, EPOLLOUT, handler);
+}
+
+void unwatch(int fd) {
+    for (auto watch = WATCHES.begin(); watch != WATCHES.end(); watch++) {
+        if (watch->fd != fd) continue;
+        if (epoll_ctl(EVENTS_EPOLL_FD, EPOLL_CTL_DEL, fd, nullptr) < 0) perror("smash error: epoll_ctl failed");
+        WATCHES.erase(watch);
+        return;
+    }
+}
+
+bool childSignalReceived() {
+    if (CHILD_FD < 0) return true;  // no reactor, always check
+
+    // the signal may still wait in the signalfd
+    struct signalfd_siginfo info;
+    while (read(CHILD_FD, &info, sizeof(info)) == sizeof(info)) CHILD_SIGNAL_RECEIVED = true;
+
+    bool received = CHILD_SIGNAL_RECEIVED;
+    CHILD_SIGNAL_RECEIVED = false;
+    return received;
+}
+
+void appendInput(const std::string& text) {
+    INPUT_BUFFER += text;
+}
+
+bool readInputLine(std::string& line) {
+    static char chunk[INPUT_READ_SIZE];
+    size_t scanned = INPUT_START;   // no newline before this
+
+    while (true) {
+        size_t newline = INPUT_BUFFER.find('\n', scanned);
+        if (newline != std::string::npos) {
+            // lines may come out of the buffer without waiting, handle the events between them
+            handleEvents(0);
+            line.assign(INPUT_BUFFER, INPUT_START, newline - INPUT_START);
+            INPUT_START = newline + 1;
+            return true;
+        }
+        scanned = INPUT_BUFFER.size();
+
+        ssize_t read_retVal = 0;    // no input fd = end of input
+        if (INPUT_FD >= 0) {
+            waitForInput();
+            read_retVal = read(INPUT_FD, chunk, sizeof(chunk));
+            if (read_retVal < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                perror("smash error: read failed");
+                return false;
+            }
+        }
+
+        if (read_retVal == 0) { // end of input, the last line may have no newline
+            if (INPUT_START == INPUT_BUFFER.size()) return false;
+            handleEvents(0);
+            line.assign(INPUT_BUFFER, INPUT_START, std::string::npos);
+            INPUT_START = INPUT_BUFFER.size();
+            return true;
+        }
+
+        // drop the returned lines once, instead of after each of them
+        INPUT_BUFFER.erase(0, INPUT_START);
+        scanned -= INPUT_START;
+        INPUT_START = 0;
+        INPUT_BUFFER.append(chunk, read_retVal);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef SMASH_REACTOR_H_
+#define SMASH_REACTOR_H_
+
+#include <string>
+#include <cstdint>
+#include <sys/types.h>
+
+// The reactor multiplexes every event smash waits for with a single epoll:
+// the input, SIGINT/SIGTSTP and SIGCHLD (read through signalfds, so nothing
+// runs in a signal handler) and the timeouts timer (a timerfd).
+// The events are handled by the handlers in signals.h, from the main flow.
+//
+// The timeouts are kept in a min-heap of CLOCK_MONOTONIC deadlines, and the
+// timerfd is always armed (with an absolute time) for the earliest one.
+
+typedef unsigned long TimerID;  // 0 is never a valid timer
+
+/// Blocks the signals smash handles and creates the event sources.
+/// Must be called before any child is created.
+/// \param input_fd - The file descriptor commands are read from, -1 for only appendInput
+/// \return False if one of the sources couldn't be created
+bool reactorInit(int input_fd);
+
+/// Handles events until the input is readable
+void waitForInput();
+
+/// Waits for at least one event other than input and handles it
+void waitForEvent();
+
+/// Adds a timer, O(log n). alarmHandler is called once it expires.
+/// \param seconds - Time until it expires, rounded to milliseconds
+/// \param pid - The job the timer belongs to, 0 for none
+/// \return The timer's id
+TimerID addTimer(double seconds, pid_t pid);
+
+/// Removes a timer that didn't expire yet, O(log n)
+void cancelTimer(TimerID timer);
+
+/// Removes the earliest timer if it expired, for alarmHandler
+/// \param timer - The expired timer's id
+/// \param pid - The job given to addTimer
+/// \return False if no timer expired
+bool popExpiredTimer(TimerID* timer, pid_t* pid);
+
+/// Calls handler once, the next time fd is readable (from the main flow, like the other events).
+/// Calling it again before that only replaces the handler.
+void watchReadableOnce(int fd, void (*handler)());
+
+/// Calls handler once, the next time fd is writable (like watchReadableOnce)
+void watchWritableOnce(int fd, void (*handler)());
+
+/// Stops watching fd, must be called before it's closed if it was watched
+void unwatch(int fd);
+
+/// \return CLOCK_MONOTONIC in nanoseconds, the clock of the timers
+int64_t monotonicNow();
+
+/// \return True if SIGCHLD was received since the last call
+bool childSignalReceived();
+
+/// Adds text to the input, before what will be read from the input file descriptor
+void appendInput(const std::string& text);
+
+/// Reads the next line of the input, handling events while waiting for it
+/// \param line - The line, without the newline
+/// \return False at the end of the input
+bool readInputLine(std::string& line);
+
+#endif //SMASH_REACTOR_H_
@@ -12,14 +12,8 @@ void ctrlZHandler(int sig_num) {
 	if (CURR_FORK_CHILD_RUNNING == 0) return;
 
     // send SIGSTOP to CURR_FORK_CHILD_RUNNING
-    pid_t gpid = getpgid(CURR_FORK_CHILD_RUNNING);
-    if (gpid < 0) {
-        perror("smash error: getgpid failed");
-        return;
-    }
-
-    // send signal, print message
-    if (killpg(gpid, SIGSTOP) < 0) {
+    // send signal to the foreground group (it's led by CURR_FORK_CHILD_RUNNING), print message
+    if (killpg(CURR_FORK_CHILD_RUNNING, SIGSTOP) < 0) {
         perror("smash error: killpg failed");
     } else {
         cout << "smash: process " << CURR_FORK_CHILD_RUNNING << " was stopped" << endl;
@@ -33,17 +27,12 @@ void ctrlCHandler(int sig_num) {
     if (CURR_FORK_CHILD_RUNNING == 0) return;
 
     // send SIGSTOP to CURR_FORK_CHILD_RUNNING
-    pid_t gpid = getpgid(CURR_FORK_CHILD_RUNNING);
-    if (gpid < 0) {
-        perror("smash error: getgpid failed");
-        return;
-    }
-
-    // send signal, print message
-    if (killpg(gpid, SIGKILL) < 0) {
+    // send signal to the foreground group (it's led by CURR_FORK_CHILD_RUNNING), print message
+    if (killpg(CURR_FORK_CHILD_RUNNING, SIGKILL) < 0) {
         perror("smash error: killpg failed");
     } else {
         cout << "smash: process " << CURR_FORK_CHILD_RUNNING << " was killed" << endl;
+        LAST_STATUS = 128 + SIGINT;     // like bash, though it's killed with SIGKILL
     }
 }
 
@@ -54,45 +43,34 @@ void alarmHandler(int sig_num) {
     // clean jobs list
     GLOBAL_JOBS_POINTER->removeFinishedJobs();
 
-    // get curr time
-    time_t curr_time = time(nullptr);
-    if (curr_time == (time_t)(-1)) {
-        perror("smash error: time failed");
-        return;
+    // kill the jobs whose timer expired, the others are still in the timers heap
+    TimerID timer;
+    pid_t pid;
+    while (popExpiredTimer(&timer, &pid)) {
+        JobEntry* job = GLOBAL_JOBS_POINTER->getJobByPid(pid);
+        // the job may have finished already (and its pid may belong to a newer job)
+        if (job == nullptr || !job->is_timeout || job->timer != timer) continue;
+
+        // send signal to the job's group, print message
+        if (killpg(job->pid, SIGKILL) < 0) {
+            perror("smash error: killpg failed");
+        } else {
+            cout << "smash: " << job->cmd_str << " timed out!" << endl;
+            job->is_timeout = false; // make sure that we don't SIGKILL a job twice
+        }
     }
+}
 
-    // iterate the job list and find timeout commands
-    TIME_UNTIL_NEXT_ALARM = numeric_limits<double>::max();
-    map<JobID,JobEntry>& jobs = GLOBAL_JOBS_POINTER->jobs;
-    for (auto& job : jobs) {
-        if (!job.second.is_timeout || job.second.pid == 0) continue;
-
-        double time_remain = (double)job.second.time_limit - difftime(curr_time, job.second.original_start_time);
-        if (time_remain < 1.0) {
-            // get group pid
-            pid_t gpid = getpgid(job.second.pid);
-            if (gpid < 0) {
-                perror("smash error: getgpid failed");
-                continue;
-            }
-
-            // send signal, print message
-            if (killpg(gpid, SIGKILL) < 0) {
-                perror("smash error: killpg failed");
-            } else {
-                cout << "smash: " << job.second.cmd_str << " timed out!" << endl;
-                job.second.is_timeout = false; // make sure that we don't SIGKILL a job twice
-            }
+void childHandler(int sig_num) {
+    // reap finished jobs right away (the processes of a foreground command that are reaped
+    // here are kept for waitForeground)
+    GLOBAL_JOBS_POINTER->removeFinishedJobs();
 
-        } else if ((unsigned int)time_remain < TIME_UNTIL_NEXT_ALARM) {
-            // TIME_UNTIL_NEXT_ALARM = minimum timeout leftover duration
-            TIME_UNTIL_NEXT_ALARM = time_remain;
-        }
-    }
+    // their slots are free now
+    SmallShell::getInstance().startQueuedJobs();
+}
 
-    // send another alarm for the next timeout command
-    if (TIME_UNTIL_NEXT_ALARM < numeric_limits<double>::max()) {
-        alarm((unsigned int)TIME_UNTIL_NEXT_ALARM);
-        TIME_AT_LAST_UPDATE = curr_time;
-    }
+void jobServerHandler() {
+    // start the queued jobs that can get a token now
+    SmallShell::getInstance().startQueuedJobs();
 }
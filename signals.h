@@ -3,8 +3,11 @@
 
 #include "Commands.h"
 
+// handlers of the events of the reactor, they run from the main flow (not in signal context)
 void ctrlZHandler(int sig_num);
 void ctrlCHandler(int sig_num);
 void alarmHandler(int sig_num);
+void childHandler(int sig_num);
+void jobServerHandler();    // a token may be free
 
 #endif //SMASH__SIGNALS_H_
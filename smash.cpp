@@ -1,35 +1,97 @@
 #include "Commands.h"
 #include "signals.h"
+#include "spawn.h"
 
 // definition of global variables
 pid_t SMASH_PROCESS_PID = 0;
 bool QUIT_SHELL = false;
 
+/// \return True if the line has nothing to run (only whitespace or a comment)
+static bool isBlankLine(const std::string& cmd_line) {
+    size_t first = cmd_line.find_first_not_of(" \t\r\f\v");
+    return first == std::string::npos || cmd_line[first] == '#';
+}
+
 int main(int argc, char* argv[]) {
     SMASH_PROCESS_PID = getpid();
 
-    if(signal(SIGTSTP , ctrlZHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-Z handler");
+    // the commands come from stdin (with a prompt), a script (-s) or the argument (-c)
+    int input_fd = STDIN;
+    bool show_prompt = true;
+    const char* commands = nullptr;
+    int job_slots = 0;      // no limit
+    bool print_stats = false;   // print the latency histograms on exit (-t)
+    bool spawn_server = false;  // launch external commands through the spawn server (-z)
+    int arg = 1;
+    for (; arg < argc; arg += 2) {
+        if (strcmp(argv[arg], "-t") == 0) {
+            print_stats = true;
+            arg--;  // no value
+        } else if (strcmp(argv[arg], "-z") == 0) {
+            spawn_server = true;
+            arg--;
+        } else if (arg + 1 == argc) {
+            break;
+        } else if (strcmp(argv[arg], "-j") == 0) {
+            job_slots = atoi(argv[arg + 1]);
+            if (job_slots < 1) break;
+        } else if (strcmp(argv[arg], "-s") == 0 && input_fd == STDIN && commands == nullptr) {
+            input_fd = open(argv[arg + 1], O_RDONLY | O_CLOEXEC);
+            if (input_fd < 0) {
+                perror("smash error: open failed");
+                return 1;
+            }
+            show_prompt = false;
+        } else if (strcmp(argv[arg], "-c") == 0 && input_fd == STDIN && commands == nullptr) {
+            commands = argv[arg + 1];
+            input_fd = -1;
+            show_prompt = false;
+        } else {
+            break;
+        }
     }
-    if(signal(SIGINT , ctrlCHandler)==SIG_ERR) {
-        perror("smash error: failed to set ctrl-C handler");
+    if (arg != argc) {
+        std::cerr << "smash error: usage: smash [-t] [-z] [-j slots] [-s script | -c commands]" << std::endl;
+        return 1;
     }
+#ifndef SMASH_TRACE
+    if (print_stats) std::cerr << "smash error: -t: smash was built without tracing (make TRACE=1)" << std::endl;
+#endif
 
-    struct sigaction act;
-    act.sa_handler = alarmHandler;
-    sigemptyset (&act.sa_mask);
-    act.sa_flags = SA_RESTART;
-
-    if(sigaction(SIGALRM , &act ,nullptr) < 0) {
-        perror("smash error: sigaction failed");
-    }
+    // ctrl-C, ctrl-Z, finished children and timeouts are all handled by the reactor
+    if (!reactorInit(input_fd)) return 1;  // the error was already printed
+    if (commands != nullptr) appendInput(commands);
+    PATH_CACHE.watchDirectories();  // without inotify, only PATH changes are noticed
 
+    // the background jobs take slots from a jobserver: our own, or make's
     SmallShell& smash = SmallShell::getInstance();
+    if (job_slots > 0) {
+        if (!smash.setJobSlots(job_slots)) return 1;
+    } else {
+        smash.joinJobServer();
+    }
+    // with -z external commands are launched by a small fork of smash, made once MAKEFLAGS and
+    // the jobserver's fds are final (otherwise, or if it fails, they use posix_spawn)
+    if (spawn_server) startSpawnServer();
+    std::string cmd_line;
     while(!QUIT_SHELL) {
-        std::cout << smash.getPrompt() + "> ";
-        std::string cmd_line;
-        std::getline(std::cin, cmd_line);
+#ifdef SMASH_TRACE
+        int64_t prompt_time = monotonicNow();
+#endif
+        if (show_prompt) std::cout << smash.getPrompt() + "> " << std::flush;
+        if (!readInputLine(cmd_line)) break;    // end of input
+#ifdef SMASH_TRACE
+        traceInput(monotonicNow() - prompt_time);
+#endif
+        if (isBlankLine(cmd_line)) continue;    // don't hand bash an empty command
         smash.executeCommand(cmd_line.c_str());
     }
+
+    // the input ended, but the queued jobs were still asked for
+    while (!QUIT_SHELL && smash.hasQueuedJobs()) waitForEvent();
+
+#ifdef SMASH_TRACE
+    if (print_stats) printTraceStats(std::cerr);
+#endif
     return 0;
-}
\ No newline at end of file
+}
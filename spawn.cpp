@@ -0,0 +1,401 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <algorithm>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+#include "latency.h"
+
+extern char** environ;
+
+// signals that smash handles, children get the default behaviour back
+static const int HANDLED_SIGNALS[] = {SIGINT, SIGTSTP, SIGALRM, SIGCHLD};
+
+#define SPAWN_SERVER_MAX_MESSAGE (64 << 10)     // a bigger request (a huge argv) uses posix_spawn
+#define SPAWN_SERVER_MAX_FDS (32)               // passed with a request, more uses posix_spawn
+#define SPAWN_SERVER_UNAVAILABLE (-2)           // returned instead of a pid, use posix_spawn
+
+// a file action of a request. The fd of a DUP2 is either one passed with the request
+// (passed is true, fd is its index) or one the child already has (an earlier target)
+struct ServerAction {
+    int type;       // SpawnFileAction::Type
+    int fd;
+    int new_fd;
+    int passed;
+};
+
+struct ServerRequest {
+    int pgid;
+    int reset_signals;
+    int action_count;
+    int argc;
+    // followed by the ServerActions, the path and the arguments (null terminated)
+};
+
+struct ServerReply {
+    pid_t pid;      // -1 if no child was created
+    int error;      // errno of the failure, 0 once the child was exec'd
+};
+
+static int SERVER_FD = -1;          // smash's end of the socketpair, -1 if the server doesn't run
+static pid_t SERVER_OWNER = 0;      // the process that started it (its forks can't use it)
+static bool SERVER_USED = true;
+
+void SpawnAttributes::addDup2(int fd, int new_fd) {
+    file_actions.push_back(SpawnFileAction(SpawnFileAction::DUP2, fd, new_fd));
+}
+
+void SpawnAttributes::addClose(int fd) {
+    file_actions.push_back(SpawnFileAction(SpawnFileAction::CLOSE, fd));
+}
+
+/// Launches a binary through the spawn server
+/// \return Like spawnExec, or SPAWN_SERVER_UNAVAILABLE if it can't (then it didn't launch anything)
+static pid_t serverSpawn(const char* path, char* const argv[], const SpawnAttributes& attr) {
+    vector<int> passed;
+    vector<ServerAction> actions;
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) return SPAWN_SERVER_UNAVAILABLE;
+    passed.push_back(cwd);
+
+    // the child starts with smash's standard fds (not the server's), the fds smash gives it
+    // replace them, and the sources of its dup2s are passed unless the child already has them
+    vector<int> child_fds;
+    for (int fd = 0; fd <= 2; fd++) {
+        if (fcntl(fd, F_GETFD) < 0) {
+            actions.push_back(ServerAction{SpawnFileAction::CLOSE, fd, -1, false});
+            continue;
+        }
+        actions.push_back(ServerAction{SpawnFileAction::DUP2, (int)passed.size(), fd, true});
+        passed.push_back(fd);
+        child_fds.push_back(fd);
+    }
+    for (const auto& action : attr.file_actions) {
+        auto child_fd = std::find(child_fds.begin(), child_fds.end(), action.fd);
+        if (action.type == SpawnFileAction::DUP2) {
+            if (child_fd != child_fds.end()) {
+                actions.push_back(ServerAction{SpawnFileAction::DUP2, action.fd, action.new_fd, false});
+            } else {
+                // sendmsg fails for the whole message if one of its fds isn't open, like dup2 would
+                if (fcntl(action.fd, F_GETFD) < 0) {
+                    close(cwd);
+                    return -1;
+                }
+                actions.push_back(ServerAction{SpawnFileAction::DUP2, (int)passed.size(), action.new_fd, true});
+                passed.push_back(action.fd);
+            }
+            if (std::find(child_fds.begin(), child_fds.end(), action.new_fd) == child_fds.end()) {
+                child_fds.push_back(action.new_fd);
+            }
+        } else if (child_fd != child_fds.end()) {   // the other fds of smash aren't in the child anyway
+            actions.push_back(ServerAction{SpawnFileAction::CLOSE, action.fd, -1, false});
+            child_fds.erase(child_fd);
+        }
+    }
+
+    ServerRequest request = {attr.pgid, attr.reset_signals, (int)actions.size(), 0};
+    vector<char> message((char*)&request, (char*)(&request + 1));
+    message.insert(message.end(), (char*)actions.data(), (char*)(actions.data() + actions.size()));
+    message.insert(message.end(), path, path + strlen(path) + 1);
+    for (; argv[request.argc] != nullptr; request.argc++) {
+        message.insert(message.end(), argv[request.argc], argv[request.argc] + strlen(argv[request.argc]) + 1);
+    }
+    memcpy(message.data(), &request, sizeof(request));
+    if (message.size() > SPAWN_SERVER_MAX_MESSAGE || passed.size() > SPAWN_SERVER_MAX_FDS) {
+        close(cwd);
+        return SPAWN_SERVER_UNAVAILABLE;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)] = {};
+    struct iovec data = {message.data(), message.size()};
+    struct msghdr header = {};
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = CMSG_SPACE(sizeof(int) * passed.size());
+    struct cmsghdr* fds = CMSG_FIRSTHDR(&header);
+    fds->cmsg_level = SOL_SOCKET;
+    fds->cmsg_type = SCM_RIGHTS;
+    fds->cmsg_len = CMSG_LEN(sizeof(int) * passed.size());
+    memcpy(CMSG_DATA(fds), passed.data(), sizeof(int) * passed.size());
+
+    ssize_t sent;
+    while ((sent = sendmsg(SERVER_FD, &header, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+    close(cwd);
+
+    ServerReply reply;
+    ssize_t received = -1;
+    if (sent >= 0) {
+        while ((received = recv(SERVER_FD, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) {}
+    }
+    if (received != sizeof(reply)) {
+        // the server is gone, launch everything with posix_spawn from now on
+        perror("smash error: spawn server failed");
+        close(SERVER_FD);
+        SERVER_FD = -1;
+        return SPAWN_SERVER_UNAVAILABLE;
+    }
+
+    if (reply.error != 0) {
+        // the child couldn't exec, it's a child of smash that only has to be reaped
+        if (reply.pid > 0 && waitpid(reply.pid, nullptr, 0) < 0) perror("smash error: waitpid failed");
+        errno = reply.error;
+        return -1;
+    }
+    return reply.pid;
+}
+
+pid_t spawnExec(const char* path, char* const argv[], const SpawnAttributes& attr) {
+    int64_t start = phaseStart();
+    if (SERVER_FD >= 0 && SERVER_USED && getpid() == SERVER_OWNER) {
+        pid_t pid = serverSpawn(path, argv, attr);
+        if (pid != SPAWN_SERVER_UNAVAILABLE) {
+            phaseEnd(PHASE_SPAWN, start);
+            return pid;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t spawn_attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&spawn_attr);
+
+    // translate the file actions
+    for (const auto& action : attr.file_actions) {
+        if (action.type == SpawnFileAction::DUP2) {
+            posix_spawn_file_actions_adddup2(&actions, action.fd, action.new_fd);
+        } else {
+            posix_spawn_file_actions_addclose(&actions, action.fd);
+        }
+    }
+
+    short flags = 0;
+    if (attr.pgid >= 0) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&spawn_attr, attr.pgid);
+    }
+    if (attr.reset_signals) {
+        sigset_t default_signals, empty_mask;
+        sigemptyset(&default_signals);
+        for (int sig : HANDLED_SIGNALS) sigaddset(&default_signals, sig);
+        sigemptyset(&empty_mask);
+
+        flags |= POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+        posix_spawnattr_setsigdefault(&spawn_attr, &default_signals);
+        posix_spawnattr_setsigmask(&spawn_attr, &empty_mask);
+    }
+    posix_spawnattr_setflags(&spawn_attr, flags);
+
+    pid_t pid;
+    int ret = posix_spawn(&pid, path, &actions, &spawn_attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&spawn_attr);
+    phaseEnd(PHASE_SPAWN, start);
+
+    if (ret != 0) {
+        errno = ret;
+        return -1;
+    }
+    return pid;
+}
+
+pid_t spawnFork(const SpawnAttributes& attr) {
+    int64_t start = phaseStart();
+    pid_t pid = fork();
+
+    if (pid == 0) { // child
+        if (attr.pgid >= 0 && setpgid(0, attr.pgid) < 0) perror("smash error: setpgid failed");
+
+        if (attr.reset_signals) {
+            for (int sig : HANDLED_SIGNALS) {
+                if (signal(sig, SIG_DFL) == SIG_ERR) perror("smash error: signal failed");
+            }
+
+            // smash blocks the signals it reads through the reactor
+            sigset_t empty_mask;
+            sigemptyset(&empty_mask);
+            if (sigprocmask(SIG_SETMASK, &empty_mask, nullptr) < 0) perror("smash error: sigprocmask failed");
+        }
+
+        for (const auto& action : attr.file_actions) {
+            if (action.type == SpawnFileAction::DUP2) {
+                if (dup2(action.fd, action.new_fd) < 0) {   // dup2 error - can't continue
+                    perror("smash error: dup2 failed");
+                    exit(0);
+                }
+            } else if (close(action.fd) < 0) {
+                perror("smash error: close failed");
+            }
+        }
+    } else if (pid > 0 && attr.pgid >= 0) { // parent
+        // set the group from here too, so it's valid even if the child wasn't scheduled yet.
+        // EACCES/ESRCH mean the child already exec'd/exited, so it already set it itself
+        pid_t pgid = attr.pgid == 0 ? pid : attr.pgid;
+        if (setpgid(pid, pgid) < 0 && errno != EACCES && errno != ESRCH) perror("smash error: setpgid failed");
+    }
+    if (pid != 0) phaseEnd(PHASE_SPAWN, start);
+
+    return pid;
+}
+
+/// In the child of the server: sets it up like spawnFork and execs the binary
+/// \return errno of what failed
+static int serverExec(const ServerRequest& request, const ServerAction* actions, vector<int>& passed,
+                      const char* path, char* const argv[]) {
+    if (request.pgid >= 0 && setpgid(0, request.pgid) < 0) return errno;
+
+    if (request.reset_signals) {
+        for (int sig : HANDLED_SIGNALS) signal(sig, SIG_DFL);
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+        sigprocmask(SIG_SETMASK, &empty_mask, nullptr);
+    }
+
+    if (fchdir(passed[0]) < 0) return errno;
+
+    // move the passed fds above every fd the actions touch, so a dup2 can't overwrite
+    // one of them before it's used (they stay close-on-exec)
+    int highest = 2;
+    for (int i = 0; i < request.action_count; i++) highest = std::max({highest, actions[i].fd, actions[i].new_fd});
+    for (int& fd : passed) {
+        if (fd <= highest && (fd = fcntl(fd, F_DUPFD_CLOEXEC, highest + 1)) < 0) return errno;
+    }
+
+    for (int i = 0; i < request.action_count; i++) {
+        const ServerAction& action = actions[i];
+        if (action.type == SpawnFileAction::CLOSE) {
+            close(action.fd);
+        } else if (dup2(action.passed ? passed[action.fd] : action.fd, action.new_fd) < 0) {
+            return errno;
+        }
+    }
+
+    execve(path, argv, environ);
+    return errno;
+}
+
+/// In the server: launches the child of one request and waits until it exec'd
+static ServerReply serverLaunch(char* message, size_t length, vector<int>& passed) {
+    ServerReply reply = {-1, EINVAL};
+
+    ServerRequest request;
+    if (length < sizeof(request)) return reply;
+    memcpy(&request, message, sizeof(request));
+    size_t strings = sizeof(request) + sizeof(ServerAction) * request.action_count;
+    if (request.action_count < 0 || request.argc < 0 || strings >= length || passed.empty()) return reply;
+    const ServerAction* actions = (const ServerAction*)(message + sizeof(request));
+    for (int i = 0; i < request.action_count; i++) {
+        if (actions[i].passed && (actions[i].fd < 0 || actions[i].fd >= (int)passed.size())) return reply;
+    }
+
+    // the path, then the arguments, each null terminated
+    vector<char*> args;
+    char* end = message + length;
+    char* next = message + strings;
+    for (int i = 0; i <= request.argc; i++) {
+        char* terminator = (char*)memchr(next, '\0', end - next);
+        if (terminator == nullptr) return reply;
+        args.push_back(next);
+        next = terminator + 1;
+    }
+    args.push_back(nullptr);
+
+    // the child reports a failure before exec here, the pipe closes without data when it exec'd
+    int error_pipe[2];
+    if (pipe2(error_pipe, O_CLOEXEC) < 0) {
+        reply.error = errno;
+        return reply;
+    }
+
+    // its parent is smash, not the server
+    pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0) {
+        int error = serverExec(request, actions, passed, args[0], args.data() + 1);
+        if (write(error_pipe[1], &error, sizeof(error)) < 0) {}
+        _exit(127);
+    }
+    reply.pid = pid;
+    reply.error = pid < 0 ? errno : 0;
+    close(error_pipe[1]);
+
+    int error;
+    ssize_t received;
+    while ((received = read(error_pipe[0], &error, sizeof(error))) < 0 && errno == EINTR) {}
+    if (received == sizeof(error)) reply.error = error;
+    close(error_pipe[0]);
+    return reply;
+}
+
+/// The loop of the server, until smash closes its end
+static void runSpawnServer(int socket_fd) {
+    vector<char> message(SPAWN_SERVER_MAX_MESSAGE);
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+    while (true) {
+        struct iovec data = {message.data(), message.size()};
+        struct msghdr header = {};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        ssize_t length = recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) return;
+
+        vector<int> passed;
+        for (struct cmsghdr* fds = CMSG_FIRSTHDR(&header); fds != nullptr; fds = CMSG_NXTHDR(&header, fds)) {
+            if (fds->cmsg_level != SOL_SOCKET || fds->cmsg_type != SCM_RIGHTS) continue;
+            const int* data_fds = (const int*)CMSG_DATA(fds);
+            passed.insert(passed.end(), data_fds, data_fds + (fds->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        }
+
+        ServerReply reply = serverLaunch(message.data(), length, passed);
+        for (int fd : passed) close(fd);
+        if (send(socket_fd, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) return;
+    }
+}
+
+bool startSpawnServer() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        perror("smash error: socketpair failed");
+        return false;
+    }
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("smash error: fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        // the server stays in smash's group with smash's signals blocked (so ctrl-C/Z don't reach it),
+        // and dies with smash
+        close(fds[0]);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent) _exit(0);
+        prctl(PR_SET_NAME, "smash-spawn");
+        runSpawnServer(fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    SERVER_FD = fds[0];
+    SERVER_OWNER = parent;
+    return true;
+}
+
+void useSpawnServer(bool use) {
+    SERVER_USED = use;
+}
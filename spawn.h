@@ -0,0 +1,64 @@
+#ifndef SMASH_SPAWN_H_
+#define SMASH_SPAWN_H_
+
+#include <vector>
+#include <unistd.h>
+#include <sys/types.h>
+
+using std::vector;
+
+// a file descriptor operation that is applied in the child before it runs
+struct SpawnFileAction {
+    enum Type { DUP2, CLOSE };
+
+    Type type;
+    int fd;
+    int new_fd;     // relevant for DUP2
+
+    SpawnFileAction(Type type, int fd, int new_fd = -1) : type(type), fd(fd), new_fd(new_fd) {}
+};
+
+class SpawnAttributes {
+public:
+    vector<SpawnFileAction> file_actions;   // applied in the order they were added
+    pid_t pgid;             // -1 = stay in the parent's group, 0 = new group led by the child, else join pgid
+    bool reset_signals;     // restore the default handlers of the signals smash catches
+
+    SpawnAttributes() : pgid(-1), reset_signals(true) {}
+    void addDup2(int fd, int new_fd);
+    void addClose(int fd);
+};
+
+/// Launches a binary through the spawn server if it runs, otherwise using posix_spawn, which
+/// doesn't copy the address space of smash (glibc implements it with clone(CLONE_VM|CLONE_VFORK)).
+/// Either way the cost doesn't grow with smash, and the binary is exec'd when it returns.
+/// \param path - Full path of the binary
+/// \param argv - Null terminated arguments array
+/// \param attr - File actions, process group and signal handling of the child
+/// \return PID of the child, or -1 if the spawn failed (errno is set)
+pid_t spawnExec(const char* path, char* const argv[], const SpawnAttributes& attr);
+
+/// Forks a child that keeps running smash code (for commands that can't be exec'd).
+/// The attributes are applied in the child before fork returns, and the process group
+/// is also set from the parent so it's valid as soon as the call returns.
+/// \param attr - File actions, process group and signal handling of the child
+/// \return Like fork(): 0 in the child, PID of the child in the parent, -1 on failure
+pid_t spawnFork(const SpawnAttributes& attr);
+
+// The spawn server (a zygote) is a small fork of smash made at startup, that launches
+// binaries for it. smash sends it each request over a socketpair, with the file
+// descriptors the child needs (its standard ones, the sources of its dup2s and the
+// current directory) passed with SCM_RIGHTS. The server clones the child with
+// CLONE_PARENT, so the child is a child of smash like any other: smash waits for it,
+// stops and continues its group and gets its SIGCHLD, while the server never grows.
+
+/// Starts the spawn server, after which spawnExec of this process uses it.
+/// The server inherits the environment and the inheritable fds (like the jobserver's)
+/// of this moment, so it must be started once they're final, while smash is still small.
+/// \return False if it couldn't be started (spawnExec keeps using posix_spawn)
+bool startSpawnServer();
+
+/// Lets spawnExec use the spawn server while it runs (the default), or posix_spawn
+void useSpawnServer(bool use);
+
+#endif //SMASH_SPAWN_H_
@@ -0,0 +1,42 @@
+#include <cstring>
+
+#include "tokenizer.h"
+
+static inline bool isWhitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v';
+}
+
+CommandTokens::CommandTokens(const char* cmd_line) : tokens(inline_tokens), count(0) {
+    size_t length = strlen(cmd_line);
+    char* chars = inline_chars;
+    if (length + 1 > TOKENIZER_INLINE_CHARS) {
+        heap_chars.resize(length + 1);
+        chars = heap_chars.data();
+    }
+    memcpy(chars, cmd_line, length + 1);
+
+    // cut the copy in place: every token ends with the null that replaced the whitespace after it
+    char* curr = chars;
+    while (true) {
+        while (isWhitespace(*curr)) curr++;
+        if (*curr == '\0') break;
+
+        addToken(curr);
+        while (*curr != '\0' && !isWhitespace(*curr)) curr++;
+        if (*curr == '\0') break;
+        *curr++ = '\0';
+    }
+    tokens[count] = nullptr;
+}
+
+void CommandTokens::addToken(const char* token) {
+    // move to the heap once the inline array is full (keeping room for the final nullptr)
+    if (tokens == inline_tokens && count == TOKENIZER_INLINE_TOKENS) {
+        heap_tokens.assign(inline_tokens, inline_tokens + count);
+    }
+    if (tokens != inline_tokens || count == TOKENIZER_INLINE_TOKENS) {
+        heap_tokens.resize(count + 2);  // the token and the nullptr
+        tokens = heap_tokens.data();
+    }
+    tokens[count++] = token;
+}
@@ -0,0 +1,40 @@
+#ifndef SMASH_TOKENIZER_H_
+#define SMASH_TOKENIZER_H_
+
+#include <cstddef>
+
+#include "arena.h"
+
+#define TOKENIZER_INLINE_CHARS (256)    // lines up to this length don't allocate
+#define TOKENIZER_INLINE_TOKENS (32)    // and neither do up to this many tokens
+
+// Splits a command line on whitespace (like the given _parseCommandLine did).
+// The line is copied once into a buffer of the object and every token is a
+// null-terminated view into it, so there is no allocation per token and no
+// limit on their number. Typical lines fit the inline buffers, longer ones spill
+// into LINE_ARENA, so the heap isn't touched at all.
+// The views are valid while the object lives, so it can't be copied.
+class CommandTokens {
+public:
+    explicit CommandTokens(const char* cmd_line);
+    CommandTokens(const CommandTokens&) = delete;
+    CommandTokens& operator=(const CommandTokens&) = delete;
+
+    int size() const { return count; }
+    const char* operator[](int index) const { return tokens[index]; }
+
+    /// \return The tokens followed by nullptr, like argv
+    const char* const* argv() const { return tokens; }
+
+private:
+    char inline_chars[TOKENIZER_INLINE_CHARS];
+    const char* inline_tokens[TOKENIZER_INLINE_TOKENS + 1];
+    LineVector<char> heap_chars;            // used if the line is too long
+    LineVector<const char*> heap_tokens;    // used if there are too many tokens
+    const char** tokens;
+    int count;
+
+    void addToken(const char* token);
+};
+
+#endif //SMASH_TOKENIZER_H_